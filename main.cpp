@@ -7,6 +7,24 @@
 #include <memory>
 #include <cstring>
 #include <cassert>
+#include <cstdarg>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <chrono>
+#include <sstream>
+#include <csignal>
+#include <iomanip>
+#include <atomic>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std::string_literals;
 
@@ -15,6 +33,124 @@ bool flag_write_kim = false;
 bool flag_write_bits = false;
 bool flag_write_wav = false;
 
+    //  File to export the demodulation statistics to
+std::string path_stats;
+
+    //  Optional destination file for each output format (empty means stdout)
+std::string path_write_data;
+std::string path_write_kim;
+std::string path_write_bits;
+std::string path_write_wav;
+
+/// @brief Buffered output. Everything that writes a lot (bits, dumps, tapes) goes through one of those, so we hit the FILE in large blocks
+class writer
+{
+    FILE *f_;
+    bool owned_ = false;
+    bool ok_ = true;
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+
+public:
+    static const size_t BUFFER_SIZE = 64*1024;
+
+    writer( FILE *f ) : f_{ f }, buffer_( BUFFER_SIZE ) {}
+    ~writer()
+    {
+        flush();
+        if (owned_)
+            ::fclose( f_ );
+    }
+
+    writer( const writer & ) = delete;
+    writer &operator=( const writer & ) = delete;
+
+    /// @brief Redirect the output to a file
+    /// @return false if the file cannot be created
+    bool open( const std::string &path )
+    {
+        flush();
+        FILE *f = ::fopen( path.c_str(), "wb" );
+        if (!f)
+            return false;
+        if (owned_)
+            ::fclose( f_ );
+        f_ = f;
+        owned_ = true;
+        return true;
+    }
+
+    void put( char c )
+    {
+        if (size_==buffer_.size())
+            flush();
+        buffer_[size_++] = c;
+    }
+
+    void write( const void *data, size_t len )
+    {
+        if (size_+len>buffer_.size())
+        {
+            flush();
+            if (len>=buffer_.size())
+            {
+                    //  Too large to be worth a copy
+                if (::fwrite( data, len, 1, f_ )!=1)
+                    ok_ = false;
+                return;
+            }
+        }
+        ::memcpy( buffer_.data()+size_, data, len );
+        size_ += len;
+    }
+
+    void print( const char *s )
+    {
+        write( s, ::strlen( s ) );
+    }
+
+    void printf( const char *format, ... ) __attribute__(( format( printf, 2, 3 ) ))
+    {
+        char tmp[1024];
+        va_list ap;
+        va_start( ap, format );
+        int len = ::vsnprintf( tmp, sizeof(tmp), format, ap );
+        va_end( ap );
+        if (len>0)
+            write( tmp, std::min( (size_t)len, sizeof(tmp)-1 ) );
+    }
+
+    /// @brief Pushes the buffered content to the file
+    /// @return false if any write failed since creation
+    bool flush()
+    {
+            //  An empty buffer is left alone, so that flushing an idle writer never races with another thread
+        if (size_)
+        {
+            if (::fwrite( buffer_.data(), size_, 1, f_ )!=1)
+                ok_ = false;
+            size_ = 0;
+        }
+        ::fflush( f_ );
+        return ok_;
+    }
+};
+
+    //  Diagnostic output (bitstream dumps, parser traces)
+writer diag{ stderr };
+
+/// @brief Returns a writer on the file, or on stdout if no path is given
+std::unique_ptr<writer> open_output( const std::string &path )
+{
+    std::unique_ptr<writer> result{ new writer{ stdout } };
+    if (path!="" && !result->open( path ))
+    {
+        std::cerr << "Could not create file " << path << "\n";
+        ::exit( EXIT_FAILURE );
+    }
+    return result;
+}
+
 std::string from_time( double t )
 {
     int s = t;
@@ -29,8 +165,36 @@ std::string from_time( double t )
     return buffer;
 }
 
+/// @brief Formats a (possibly very long) duration, for progress reports
+std::string from_duration( double t )
+{
+    char buffer[1024];
+
+    if (t>=365*86400.0)
+        ::sprintf( buffer, "%.0f years", t/(365*86400.0) );
+    else
+    {
+        long s = t;
+        if (s>=86400)
+            ::sprintf( buffer, "%ldd %02ld:%02ld:%02ld", s/86400, s/3600%24, s/60%60, s%60 );
+        else
+            ::sprintf( buffer, "%02ld:%02ld:%02ld", s/3600, s/60%60, s%60 );
+    }
+
+    return buffer;
+}
+
 bool silent = true;
 bool verbose = false;
+bool quiet = false;     //  No progress or information messages (server mode)
+
+/// @brief True if the parser writes traces to diag. The diag writer is not thread safe, so a single thread traces at a
+/// time: the caller's, or the demodulator thread of decode_pipelined() while the caller only collects the bits, and diag
+/// is flushed by the caller once that thread is joined
+bool tracing()
+{
+    return !silent || verbose;
+}
 
 
 
@@ -112,7 +276,32 @@ public:
     /// @return The number of different values that the 'bits' member function can take
     size_t fix_count() const
     {
-        return 1<<errors_.size();
+        assert( errors_.size()<64 );
+        return (size_t)1<<errors_.size();
+    }
+
+    size_t error_count() const
+    {
+        return errors_.size();
+    }
+
+    const std::vector<bool> &raw_bits() const
+    {
+        return bits_;
+    }
+
+    const std::vector<fix_t> &errors() const
+    {
+        return errors_;
+    }
+
+    /// @brief For each bit, is it unknown
+    std::vector<bool> error_mask() const
+    {
+        std::vector<bool> result( bits_.size(), false );
+        for (auto &e:errors_)
+            result[e.bit_location] = true;
+        return result;
     }
 
     /// @brief Returns the bits with a certain fix
@@ -128,7 +317,7 @@ public:
         result = bits_;
 
         for (auto e:errors_)
-            result[e.bit_location] = fix&(1<<ix++);
+            result[e.bit_location] = fix&((size_t)1<<ix++);
 
         return result;
     }
@@ -179,28 +368,34 @@ public:
             if (patch_instuctions=="")
                 patch_instuctions = "x";
 
-            std::clog << "Location in bitstream for corrupted segments:\n";
-            for (int i=0;i!=errors_.size();i++)
+            if (!quiet)
+                diag.print( "Location in bitstream for corrupted segments:\n" );
+            for (size_t i=0;i!=errors_.size();i++)
             {
                 auto e = errors_[i];
-                std::clog << "  " << from_time( e.source_ts ) << "-" << from_time( e.source_ts+7.452/1000 ) << " -- bit #" << e.bit_location;
+                if (!quiet)
+                    diag.printf( "  %s-%s -- bit #%zu", from_time( e.source_ts ).c_str(), from_time( e.source_ts+7.452/1000 ).c_str(), e.bit_location );
                 switch (patch_instuctions[i%patch_instuctions.size()])
                 {
                     case '0':
                         bits_[e.bit_location] = 0;
-                        std::clog << " inserted 0\n";
+                        if (!quiet)
+                            diag.print( " inserted 0\n" );
                         break;
                     case '1':
                         bits_[e.bit_location] = 1;
-                        std::clog << " inserted 1\n";
+                        if (!quiet)
+                            diag.print( " inserted 1\n" );
                         break;
                     case 'x':
                         bits_[e.bit_location] = 1;
-                        std::clog << " unchanged\n";
+                        if (!quiet)
+                            diag.print( " unchanged\n" );
                         new_errors.push_back( e );
                         break;
                 }
             }
+            diag.flush();
 
             errors_ = new_errors;
         }
@@ -213,13 +408,14 @@ public:
         for (auto b:bits_)
         {
             c++;
-            fprintf( stderr, "%c", b?'0':'1' );
+            diag.put( b?'0':'1' );
             if (c%8==0)
-                fprintf( stderr, " " );
+                diag.put( ' ' );
             if (c%64==0)
-                fprintf( stderr, "\n" );
+                diag.put( '\n' );
         }
-        fprintf( stderr, "\n" );
+        diag.put( '\n' );
+        diag.flush();
     }
 
     void dump_hexa( size_t offset = 0 ) const
@@ -242,32 +438,33 @@ public:
 
         for (int i=0;i<bytes.size();i+=16)
         {
-            fprintf( stderr, "%04X:", i );
+            diag.printf( "%04X:", i );
 
             for (int j=0;j!=16;j++)
             {
                 if (i+j<bytes.size())
-                    fprintf( stderr,  " %02X", bytes[i+j] );
+                    diag.printf( " %02X", bytes[i+j] );
                 else
-                    fprintf( stderr, "   " );
+                    diag.print( "   " );
                 if ((j%4)==3)
-                    fprintf( stderr, " " );
+                    diag.put( ' ' );
             }
 
-            fprintf( stderr, ": " );
+            diag.print( ": " );
 
             for (int j=0;j!=16;j++)
                 if (i+j<bytes.size())
                 {
                     if (::isgraph(bytes[i+j]))
-                        fprintf( stderr, "%c", bytes[i+j] );
+                        diag.put( bytes[i+j] );
                     else
-                        fprintf( stderr, "." );
+                        diag.put( '.' );
                     if ((j%4)==3)
-                        fprintf( stderr, " " );
+                        diag.put( ' ' );
                 }
-            fprintf( stderr, "\n" );
+            diag.put( '\n' );
         }
+        diag.flush();
     }
 
 };
@@ -305,52 +502,427 @@ typedef enum
 }   e_freq;
 
 
-constexpr double DELTA=1/22050.0/2;
+//  Duration of a bit on tape (3 cycles of 2.484ms)
+constexpr double BIT_DURATION = 7.452/1000;
+
+constexpr sample_t MID = 128;
+
+//  constexpr helpers to turn the floating point tolerances into integer bounds
+constexpr size_t floor_above( double v ) { return (size_t)v+1; }                //  smallest integer > v
+constexpr size_t ceil_below( double v ) { return (size_t)v-((size_t)v==v); }    //  largest integer < v
+constexpr int floor_log2( double v ) { return v<2?0:1+floor_log2( v/2 ); }       //  largest n with 2^n <= v
+
+/// @brief Diagnostics gathered during demodulation: histograms of crossing widths and pulse groups, and when the damage is
+struct parser_stats
+{
+    enum e_event { kStar, kQuestion, kHash };      //  The '*', '?' and '#' of the silent false mode
+
+    static const int MAX_GROUP = 32;
+
+    uint32_t rate = 0;
+    double width_9 = 0;
+    double width_6 = 0;
+    size_t window_9[2] = { 0, 0 };
+    size_t window_6[2] = { 0, 0 };
+
+    std::vector<uint32_t> widths;                       //  Crossing widths in samples, the last bin is for anything wider
+    uint32_t groups[MAX_GROUP][MAX_GROUP] = {};         //  Pulse groups by count of 9 and 6 pulses (capped)
+    std::vector<std::array<uint32_t,3>> timeline;       //  Events per second
+
+    void event( size_t sample, e_event kind )
+    {
+        size_t second = sample/rate;
+        if (second>=timeline.size())
+            timeline.resize( second+1, { 0, 0, 0 } );
+        timeline[second][kind]++;
+    }
+
+    void merge( const parser_stats &other )
+    {
+        if (rate==0)
+        {
+            *this = other;
+            return;
+        }
+        widths.resize( std::max( widths.size(), other.widths.size() ), 0 );
+        for (size_t i=0;i!=other.widths.size();i++)
+            widths[i] += other.widths[i];
+        for (int i=0;i!=MAX_GROUP;i++)
+            for (int j=0;j!=MAX_GROUP;j++)
+                groups[i][j] += other.groups[i][j];
+        timeline.resize( std::max( timeline.size(), other.timeline.size() ), { 0, 0, 0 } );
+        for (size_t i=0;i!=other.timeline.size();i++)
+            for (int k=0;k!=3;k++)
+                timeline[i][k] += other.timeline[i][k];
+    }
+};
+
+/// @brief Output of the demodulation: the bitstream, plus where each bit and each damaged spot is in the samples
+struct demodulated
+{
+    std::vector<bool> bits;
+    std::vector<fix_t> fixes;
+    std::vector<size_t> positions;      //  Sample offset of each bit
+    std::vector<size_t> damage;         //  Sample offset of each '*' or '?'
+    parser_stats stats;
+    std::vector<sample_t> source;       //  Samples the fix timestamps refer to (single take only), for the synthesis_verifier
+
+    bitstream get_bitstream() const
+    {
+        return bitstream{ bits, fixes };
+    }
+
+    /// @brief Timestamp of each bit in the source, in seconds (empty if the positions are not known)
+    std::vector<double> bit_times() const
+    {
+        std::vector<double> result;
+        if (stats.rate==0 || positions.size()!=bits.size())
+            return result;
+        for (auto p:positions)
+            result.push_back( p/(double)stats.rate );
+        return result;
+    }
+
+    /// @brief Appends the demodulation of a later part of the same samples
+    void append( const demodulated &other )
+    {
+        for (auto f:other.fixes)
+            fixes.push_back( { f.bit_location+bits.size(), f.source_ts } );
+        bits.insert( bits.end(), other.bits.begin(), other.bits.end() );
+        positions.insert( positions.end(), other.positions.begin(), other.positions.end() );
+        damage.insert( damage.end(), other.damage.begin(), other.damage.end() );
+        stats.merge( other.stats );
+    }
+};
+
+    //  Hysteresis value asking the crossing detector to derive its band from the signal amplitude
+const int HYSTERESIS_AUTO = -1;
+
+    //  Interval entry meaning that this many 1/256th of samples passed without a crossing (for silences over ~4 minutes)
+const uint32_t NO_CROSSING = UINT32_MAX;
+
+#ifdef __SSE2__
+    //  Bit i is set if sample i of the 16 at p is at or above MID and the one before is below. carry: the sample before p is above
+inline unsigned rising_mask( const sample_t *p, unsigned &carry )
+{
+        //  The side of MID is the high bit of the sample
+    unsigned high = _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *)p ) );
+    unsigned rise = high & ~((high<<1)|carry) & 0xffff;
+    carry = high>>15;
+    return rise;
+}
+#endif
+
+/// @brief Finds the rising crossings of the signal, which is all the parser needs from the samples.
+/// Each crossing is refined to 1/256th of sample by linear interpolation, and stored as the interval since the previous one.
+/// Without hysteresis, SSE2 tests 16 samples with one movemask (see rising_mask)
+class crossing_detector
+{
+    size_t index_;              //  Sample index of the next sample
+    uint64_t last_;             //  Time of the last crossing, in 1/256th of samples
+    bool high_ = false;         //  We start "lower than MID"
+    int prev_ = MID-1;          //  Last sample seen
+
+        //  Schmitt trigger: going high needs sample>=upper, going low needs sample<lower. Both are MID without hysteresis
+    int hysteresis_;
+    int upper_ = MID;
+    int lower_ = MID;
+    int envelope_ = 0;          //  Peak of |sample-MID|, in 1/256th, for HYSTERESIS_AUTO
+    int envelope_shift_;
+
+    void emit( size_t index, int a, int b, int level, std::vector<uint32_t> &intervals )
+    {
+            //  Sample a (below level) is at index-1, b (at or above level) at index
+        int fraction = b>a?std::min( std::max( (level-a)*256/(b-a), 1 ), 256 ):256;
+        uint64_t tick = ((uint64_t)index<<8)+fraction;
+        uint64_t interval = tick-last_;
+        while (interval>=NO_CROSSING)
+        {
+            intervals.push_back( NO_CROSSING );
+            interval -= NO_CROSSING;
+        }
+        intervals.push_back( interval );
+        last_ = tick;
+    }
+
+    void process_mid( const sample_t *b, const sample_t *e, std::vector<uint32_t> &intervals )
+    {
+        const sample_t *p = b;
+#ifdef __SSE2__
+        unsigned carry = high_;
+        for (;e-p>=16;p+=16)
+        {
+            unsigned rise = rising_mask( p, carry );
+            while (rise)
+            {
+                int k = __builtin_ctz( rise );
+                emit( index_+(p-b)+k, (p!=b || k)?p[k-1]:prev_, p[k], MID, intervals );
+                rise &= rise-1;
+            }
+        }
+        if (p!=b)
+        {
+            high_ = carry;
+            prev_ = p[-1];
+        }
+#endif
+        for (;p!=e;p++)
+        {
+            bool high = *p>=MID;
+            if (high && !high_)
+                emit( index_+(p-b), prev_, *p, MID, intervals );
+            high_ = high;
+            prev_ = *p;
+        }
+    }
+
+    void process_band( const sample_t *b, const sample_t *e, std::vector<uint32_t> &intervals )
+    {
+        for (auto p=b;p!=e;p++)
+        {
+            int s = *p;
+            if (hysteresis_==HYSTERESIS_AUTO)
+            {
+                    //  The envelope decays over ~5ms, and the band is a quarter of it
+                int a = std::abs( s-(int)MID )<<8;
+                if (a>envelope_)
+                    envelope_ = a;
+                else
+                    envelope_ -= envelope_>>envelope_shift_;
+                upper_ = MID+(envelope_>>10);
+                lower_ = MID-(envelope_>>10);
+            }
+            if (!high_ && s>=upper_)
+            {
+                emit( index_+(p-b), prev_, s, upper_, intervals );
+                high_ = true;
+            }
+            else if (high_ && s<lower_)
+                high_ = false;
+            prev_ = s;
+        }
+    }
+
+public:
+        //  start is the index of the first sample, hysteresis the half width of the band around MID (or HYSTERESIS_AUTO)
+    crossing_detector( uint32_t rate, size_t start, int hysteresis )
+        : index_{ start }, last_{ (uint64_t)start<<8 }, hysteresis_{ hysteresis }, envelope_shift_{ floor_log2( rate*0.005 ) }
+    {
+        if (hysteresis>0)
+        {
+            upper_ = MID+hysteresis;
+            lower_ = MID-hysteresis;
+        }
+    }
+
+        //  Appends to intervals the crossings of the samples [b,e), which follow the ones already processed
+    void process( const sample_t *b, const sample_t *e, std::vector<uint32_t> &intervals )
+    {
+        if (hysteresis_==0)
+            process_mid( b, e, intervals );
+        else
+            process_band( b, e, intervals );
+        index_ += e-b;
+    }
+};
+
+/// @brief The crossings of a whole buffer. About 1/10th of the size of the samples, and enough to re-run the parser with other settings
+struct crossings_t
+{
+    size_t start = 0;                   //  Sample index the first interval is counted from
+    std::vector<uint32_t> intervals;    //  In 1/256th of samples, see crossing_detector
+};
+
+crossings_t extract_crossings( const std::vector<sample_t> &data, uint32_t rate, size_t start, int hysteresis )
+{
+    crossings_t result{ start, {} };
+    result.intervals.reserve( data.size()/8 );
+    crossing_detector{ rate, start, hysteresis }.process( data.data(), data.data()+data.size(), result.intervals );
+    return result;
+}
+
+//  Tests the SSE2 crossing detection against the scalar loop: samples fed one at a time never fill a block of 16
+void test_crossings()
+{
+        //  Random samples (with runs at MID and at the extremes), then a noisy tone
+    std::vector<sample_t> samples( 8192 );
+    uint32_t seed = 1;
+    for (size_t i=0;i!=samples.size();i++)
+    {
+        seed = seed*1103515245+12345;
+        int noise = (seed>>16)%41-20;
+        if (i<4096)
+            samples[i] = i%512<32 ? (i%64<32?MID:(i&1)*255) : seed>>24;
+        else
+            samples[i] = std::min( std::max( MID+(int)(100*::sin( i*0.7 ))+noise, 0 ), 255 );
+    }
+
+    std::vector<uint32_t> vector, scalar, chunked;
+    crossing_detector{ 44100, 0, 0 }.process( samples.data(), samples.data()+samples.size(), vector );
+    crossing_detector one{ 44100, 0, 0 };
+    for (size_t i=0;i!=samples.size();i++)
+        one.process( samples.data()+i, samples.data()+i+1, scalar );
+        //  Blocks that do not start on a multiple of 16, so the carry goes through the scalar tail
+    crossing_detector blocks{ 44100, 0, 0 };
+    for (size_t i=0;i<samples.size();i+=37)
+        blocks.process( samples.data()+i, samples.data()+std::min( i+37, samples.size() ), chunked );
+    assert( scalar.size()>1000 );
+    assert( vector==scalar && chunked==scalar );
+}
 
+/// @brief Demodulates a KIM-1 tape sampled at SAMPLE_RATE Hz, from the intervals between its rising crossings.
+/// Time is kept as an integer in 1/256th of samples, and all widths are integers, so the inner loop has no floating point.
+/// With the default tolerance, the pulse windows are constants folded in the compares; a TOLERANT parser scales them at run time
+template <uint32_t SAMPLE_RATE, bool TOLERANT = false>
 struct Parser
 {
-    static const sample_t MID = 128;
-    static constexpr double width_9 = (7.452/3)/9/1000;
-    static constexpr double width_6 = (7.452/3)/6/1000;
+        //  Theoretical width of pulses, in samples
+    static constexpr double width_9 = SAMPLE_RATE*(BIT_DURATION/3)/9;
+    static constexpr double width_6 = SAMPLE_RATE*(BIT_DURATION/3)/6;
     static constexpr double width_epsilon = width_9/3;
 
-    double time = 0;
+        //  Bit insertion is done in 1/256th of samples, so repeated insertions don't drift
+    static constexpr uint64_t bit_ticks = SAMPLE_RATE*BIT_DURATION*256+0.5;
+    static constexpr uint64_t gap_ticks = SAMPLE_RATE*(10.0/1000)*256;
+
+        //  An unclassifiable group this close to the previous bit is part of it (closer to an erasure than to a valid bit).
+        //  Further than reach, the signal was lost, and only a valid bit will tell how many bits are missing
+    static constexpr uint64_t fold_ticks = bit_ticks*7/10;
+    static constexpr uint64_t fragment_ticks = bit_ticks/2;
+    static constexpr uint64_t reach_ticks = bit_ticks*3;
 
-    bool state = true;    //  We start "lower than MID"
+        //  Accepted windows, in 1/256th of samples. The windows overlap at every rate, and like the original floating point
+        //  parser, the 9 window is tested first over its whole range: the 6 window only starts after it
+    static constexpr uint64_t default_min_9 = floor_above( 256*(width_9-width_epsilon) );
+    static constexpr uint64_t default_max_9 = ceil_below( 256*(width_9+width_epsilon) );
+    static constexpr uint64_t default_min_6 = std::max<uint64_t>( floor_above( 256*(width_6-width_epsilon) ), default_max_9+1 );
+    static constexpr uint64_t default_max_6 = ceil_below( 256*(width_6+width_epsilon) );
 
-    double last_time = 0;
+        //  Same, scaled by the tolerance (TOLERANT only)
+    uint64_t min_9_ = default_min_9, max_9_ = default_max_9, min_6_ = default_min_6, max_6_ = default_max_6;
+
+    uint64_t min_9() const { return TOLERANT?min_9_:default_min_9; }
+    uint64_t max_9() const { return TOLERANT?max_9_:default_max_9; }
+    uint64_t min_6() const { return TOLERANT?min_6_:default_min_6; }
+    uint64_t max_6() const { return TOLERANT?max_6_:default_max_6; }
+
+    size_t time = 0;        //  Sample index of the current crossing
+    uint64_t tick = 0;      //  Same, in 1/256th of samples
+    uint64_t width = 0;     //  Time since the last crossing, in 1/256th of samples
 
     std::vector<bool> result;
+    std::vector<size_t> positions;  //  Sample index of each bit in result
+    std::vector<size_t> damage;     //  Sample index of each '*' or '?'
+
+    parser_stats stats;
+
+        //  start is the index of the first sample, so positions and timestamps stay absolute when parsing a window
+        //  tolerance scales the accepted deviation from the theoretical widths (1: a third of a 9 pulse), only for a TOLERANT parser
+    Parser( size_t start = 0, double tolerance = 1 ) : time{ start }, tick{ (uint64_t)start<<8 }
+    {
+        assert( TOLERANT || tolerance==1 );
+        if (TOLERANT)
+        {
+            double epsilon = width_epsilon*std::min( std::max( tolerance, 0.1 ), 2.0 );
+            min_9_ = floor_above( 256*(width_9-epsilon) );
+            max_9_ = ceil_below( 256*(width_9+epsilon) );
+            min_6_ = std::max<uint64_t>( floor_above( 256*(width_6-epsilon) ), max_9_+1 );
+            max_6_ = ceil_below( 256*(width_6+epsilon) );
+        }
+
+        stats.rate = SAMPLE_RATE;
+        stats.width_9 = width_9;
+        stats.width_6 = width_6;
+        stats.window_9[0] = (min_9()+255)>>8;
+        stats.window_9[1] = max_9()>>8;
+        stats.window_6[0] = (min_6()+255)>>8;
+        stats.window_6[1] = max_6()>>8;
+        stats.widths.resize( 2*ceil_below( width_6+width_epsilon )+2, 0 );
+    }
 
-        //  The time at which we fond the last valid transition
-    double last_valid_bit = -1;
+        //  The time at which we fond the last valid transition (in 1/256th of samples)
+    uint64_t last_valid_bit = 0;
     bool first = true;
 
     std::vector<fix_t> fixes;
 
-    void add_bit( int bit )
+    static double seconds( size_t samples ) { return samples/(double)SAMPLE_RATE; }
+
+    bool erasure = false;               //  The last bit is an erasure (from an unclassifiable group)
+    uint64_t before_erasure = 0;        //  last_valid_bit before that erasure
+
+    //  Inserts arbitrary bits, every bit period from the last valid one, until now
+    void fill_gap( uint64_t now )
     {
         if (!first)
-            while (time-last_valid_bit>10.0/1000)
+            while (now-last_valid_bit>gap_ticks)
             {
                 if (!silent)
-                    std::clog << "#";
+                    diag.put( '#' );
+                stats.event( last_valid_bit>>8, parser_stats::kHash );
                     //  We insert an arbitrary bit
-                fixes.push_back( { result.size(), last_valid_bit } );
+                fixes.push_back( { result.size(), last_valid_bit/256.0/SAMPLE_RATE } );
                 result.push_back( 1 );
-                last_valid_bit += 7.452/1000;
+                positions.push_back( last_valid_bit>>8 );
+                last_valid_bit += bit_ticks;
             }
+    }
+
+    void add_bit( int bit )
+    {
+        uint64_t now = tick;
+
+                //  A valid bit right after an erasure covers the same bit period: the erasure was a fragment of it
+        if (erasure && now-last_valid_bit<fold_ticks)
+            remove_erasure();
+        erasure = false;
+
+        fill_gap( now );
         first = false;
-        last_valid_bit = time;
+        last_valid_bit = now;
 
         result.push_back( bit );
+        positions.push_back( time );
         if (!silent)
         {
-            std::clog << bit;
-            // std::clog << "(" << from_time(time) << ") ";
+            diag.put( '0'+bit );
+            // std::clog << "(" << from_time(seconds(time)) << ") ";
         }
     }
 
+    void remove_erasure()
+    {
+        fixes.pop_back();
+        result.pop_back();
+        positions.pop_back();
+        last_valid_bit = before_erasure;
+        erasure = false;
+    }
+
+    //  Called for a group that is neither a 0 nor a 1: it still stands for a bit, whose value we don't know.
+    //  A group right after a valid bit is a fragment of it. Adjacent ambiguous groups are one damaged bit, which ends with the last one
+    void add_erasure()
+    {
+        uint64_t now = tick;
+        if (first)
+            return;
+        if (erasure && now-last_valid_bit<fold_ticks)
+            remove_erasure();
+        else if (now-last_valid_bit<fragment_ticks || now-last_valid_bit>reach_ticks)
+            return;
+
+        fill_gap( now );
+            //  Like the bits inserted by fill_gap(), the erasure is dated from its start (its end is only seen with the next bit)
+        fixes.push_back( { result.size(), (now>bit_ticks?now-bit_ticks:0)/256.0/SAMPLE_RATE } );
+        result.push_back( 1 );
+        positions.push_back( time );
+
+            //  So the gap heuristic counts the next missing bits from here
+        before_erasure = last_valid_bit;
+        last_valid_bit = now;
+        erasure = true;
+    }
+
     double is_6_ = true;     //  We start at the same 6 to 9 pulse sequence
 
     int counter[2] = { 0, 0 };
@@ -363,6 +935,7 @@ struct Parser
         {
             int c9 = counter[false];
             int c6 = counter[true];
+            stats.groups[std::min( c9, parser_stats::MAX_GROUP-1 )][std::min( c6, parser_stats::MAX_GROUP-1 )]++;
             if (c9==9 || c9==11) c9 = 10;
             if (c9==17 || c9==19) c9 = 18;
             if (c6==10 || c6==12) c6 = 11;
@@ -373,15 +946,14 @@ struct Parser
             else
             {
                 //  We were unable to find if this is a 0 or a 1
+                damage.push_back( time );
+                stats.event( time, parser_stats::kQuestion );
                 if (verbose)
-                    std::clog << "? (" << from_time(time) << " " << counter[false] << "/" << counter[true] << ")";
+                    diag.printf( "? (%s %d/%d)", from_time(seconds(time)).c_str(), counter[false], counter[true] );
                 else
-                    if (!silent) std::clog << "?";
+                    if (!silent) diag.put( '?' );
 
-                // //  We add a '0' anyway
-                // add_bit( 0 );
-                // add_bit( 1 );
-                // add_bit( 0 );
+                add_erasure();
             }
 
             counter[0] = counter[1] = 0;
@@ -390,46 +962,39 @@ struct Parser
         is_6_ = is_6;
     }
 
-    //  Called for each zero-crossing
-    void zero_cross()
+    //  Called for each zero-crossing, w is the time since the previous one
+    void zero_cross( uint64_t w )
     {
-        double w = time-last_time;
-        last_time = time;
+        stats.widths[std::min( (size_t)((w+128)>>8), stats.widths.size()-1 )]++;
 
-// std::cout << "(" << w << " " << width_9 << ")";
-
-        if (::fabs(w-width_9)<width_epsilon)
+            //  Unsigned wrap turns each window check into a single compare
+        if (w-min_9()<=max_9()-min_9())
             add_pulse( false );
-        else if (::fabs(w-width_6)<width_epsilon)
+        else if (w-min_6()<=max_6()-min_6())
             add_pulse( true );
         else
         {
             //  We have a zero crossing that is not of the correct frequency
+            damage.push_back( time );
+            stats.event( time, parser_stats::kStar );
             if (verbose)
-                std::clog << "\nZERO CROSSING AT " << from_time(time) << " : width = " << w <<
-                " 9 = [" << width_9-width_epsilon << "-" << width_9+width_epsilon << "] "
-                " 6 = [" << width_6-width_epsilon << "-" << width_6+width_epsilon << "]\n";
+                diag.printf( "\nZERO CROSSING AT %s : width = %.2f 9 = [%.2f-%.2f]  6 = [%.2f-%.2f]\n",
+                    from_time(seconds(time)).c_str(), w/256.0, min_9()/256.0, max_9()/256.0, min_6()/256.0, max_6()/256.0 );
             else
-                if (!silent) std::clog << "*";
-        }
-    }
-
-    //  Called to add each sample
-    void add( bool low )
-    {
-        if (state != low)           //  We changed state from LOW->HIGH or HIGH->LOW
-        {
-            state = low;
-            if (!low)               //  Now in HIGH
-                zero_cross();       //  Zero cross
+                if (!silent) diag.put( '*' );
         }
     }
 
-    //  Called to add each sample
-    void add( const sample_t sample )
+    //  Called for each interval of the crossing_detector
+    void add( uint32_t interval )
     {
-        time += DELTA;
-        add( sample<MID );
+        tick += interval;
+        width += interval;
+        if (interval==NO_CROSSING)
+            return;
+        time = tick>>8;
+        zero_cross( width );
+        width = 0;
     }
 
     //  Converts into a bitstream (we should do everything on a bitstream in reality)
@@ -437,8 +1002,76 @@ struct Parser
     {
         return bitstream{ result, fixes };
     }
+
+    demodulated get_demodulated()
+    {
+        return { result, fixes, positions, damage, stats, {} };
+    }
 };
 
+//  Tests for the pulse classification
+void test_parser()
+{
+        //  At 44.1kHz the 9 window is 8.1-16.2 samples and the 6 one 14.2-22.3: a 16 samples crossing is a 9 pulse
+    Parser<44100> p;
+    p.zero_cross( 12*256 );         //  Ends the (empty) group before, and starts a group of 9 pulses
+    p.zero_cross( 16*256 );
+    assert( p.counter[false]==1 && p.counter[true]==0 );
+    p.zero_cross( 17*256 );
+    assert( p.counter[true]==1 );
+}
+
+/// @brief Runs a parser over the crossings
+template <class P>
+demodulated run_parser( P &p, const crossings_t &crossings )
+{
+    for (auto interval:crossings.intervals)
+        p.add( interval );
+    return p.get_demodulated();
+}
+
+/// @brief Runs the parser specialized for SAMPLE_RATE (and for the default tolerance) over the crossings
+template <uint32_t SAMPLE_RATE>
+demodulated demodulate( const crossings_t &crossings, double tolerance )
+{
+    if (tolerance==1)
+    {
+        Parser<SAMPLE_RATE> p{ crossings.start };
+        return run_parser( p, crossings );
+    }
+    Parser<SAMPLE_RATE,true> p{ crossings.start, tolerance };
+    return run_parser( p, crossings );
+}
+
+/// @brief Sample rates we have a specialized parser for
+bool supported_rate( uint32_t rate )
+{
+    return rate==22050 || rate==44100 || rate==48000 || rate==96000;
+}
+
+/// @brief Demodulates crossings extracted by extract_crossings(), dispatching on the sample rate
+/// @param tolerance scale of the accepted pulse width deviation
+demodulated demodulate( const crossings_t &crossings, uint32_t rate, double tolerance = 1 )
+{
+    switch (rate)
+    {
+        case 22050: return demodulate<22050>( crossings, tolerance );
+        case 44100: return demodulate<44100>( crossings, tolerance );
+        case 48000: return demodulate<48000>( crossings, tolerance );
+        case 96000: return demodulate<96000>( crossings, tolerance );
+    }
+    assert( supported_rate( rate ) );
+    return {};
+}
+
+/// @brief Demodulates the samples
+/// @param start sample index of data[0] in the source
+/// @param hysteresis half width of the threshold band around MID, or HYSTERESIS_AUTO
+demodulated demodulate( const std::vector<sample_t> &data, uint32_t rate, size_t start = 0, int hysteresis = 0, double tolerance = 1 )
+{
+    return demodulate( extract_crossings( data, rate, start, hysteresis ), rate, tolerance );
+}
+
 std::string string_from_bits( std::vector<bool>::const_iterator b, const std::vector<bool>::const_iterator e )
 {
     uint8_t ch;
@@ -542,16 +1175,17 @@ struct kim_data
         return result;
     }
 
-    void dump()
+    void dump() const
     {
-        fprintf( stderr, "ID: %02X LOADED AT: %04X", id, adrs );
+        diag.printf( "ID: %02X LOADED AT: %04X", id, adrs );
         for (int i=3;i!=data.size();i++)
         {
             if ((i%16)==3)
-                fprintf( stderr, "\n    " );
-            fprintf( stderr, "%02X ", data[i] );
+                diag.print( "\n    " );
+            diag.printf( "%02X ", data[i] );
         }
-        fprintf( stderr, "\n" );
+        diag.put( '\n' );
+        diag.flush();
     }
 
     bool operator==( const kim_data &other ) const
@@ -569,13 +1203,14 @@ struct kim_data
 
 };
 
-/// @brief Write data as binary to stdout. Note it just writes the content. Also dumps ID, address and checksum on stderr
+/// @brief Write data as binary. Note it just writes the content. Also dumps ID, address and checksum on stderr
 /// @param kd data to be written
 /// @return true of write successful
-bool write_data( const kim_data &kd )
+bool write_data( const kim_data &kd, writer &out )
 {
     fprintf( stderr, "Writing data for ID=%02X ADRS=%04X CHKSUM=%04X\n", (int)kd.id, (int)kd.adrs, (int)kd.compute_checksum() );
-    return fwrite( kd.data.data()+3, kd.data.size()-3, 1, stdout )==1;  //  #### Ugly +/- 3
+    out.write( kd.data.data()+3, kd.data.size()-3 );  //  #### Ugly +/- 3
+    return out.flush();
 }
 
 // #### Swap arguments
@@ -613,13 +1248,14 @@ std::vector<uint8_t> kim_encode( const kim_data &kd )
     return bytes;
 }
 
-bool write_kim( const kim_data &kd )
+bool write_kim( const kim_data &kd, writer &out )
 {
     fprintf( stderr, "Writing KIM-1 for ID=%02X ADRS=%04X CHKSUM=%04X\n", (int)kd.id, (int)kd.adrs, (int)kd.compute_checksum() );
 
     auto bytes = kim_encode( kd );
 
-    return fwrite( bytes.data(), bytes.size(), 1, stdout )==1;
+    out.write( bytes.data(), bytes.size() );
+    return out.flush();
 }
 
 std::vector<bool> kim_encode_bits( const kim_data &kd )
@@ -637,20 +1273,18 @@ std::vector<bool> kim_encode_bits( const kim_data &kd )
     return bits;
 }
 
-bool write_bits( const kim_data &kd )
+bool write_bits( const kim_data &kd, writer &out )
 {
     fprintf( stderr, "Writing KIM-1 tape bits for ID=%02X ADRS=%04X CHKSUM=%04X\n", (int)kd.id, (int)kd.adrs, (int)kd.compute_checksum() );
 
     auto bits = kim_encode_bits( kd );
 
     for (auto b:bits)
-    {
-        std::cout << (int)b;
-    }
+        out.put( '0'+b );
 
-    std::cout << "\n";
+    out.put( '\n' );
 
-    return true;
+    return out.flush();
 }
 
 #define RATE 44100.0
@@ -663,34 +1297,34 @@ void write_wav_silence( std::vector<uint8_t> &bytes )
         bytes .push_back( 128 );
 }
 
-void write_wav_freq( double freq, double duration, std::vector<uint8_t> &bytes )
+void write_wav_freq( double freq, double duration, std::vector<uint8_t> &bytes, double rate = RATE )
 {
-    size_t samples = duration*RATE-0.5;
+    size_t samples = duration*rate-0.5;
     for (size_t t=0;t!=samples;t++)
-        bytes.push_back( 128+::sin(t/RATE*2*M_PI*freq)*80 );
+        bytes.push_back( 128+::sin(t/rate*2*M_PI*freq)*80 );
 }
 
-void write_wav_2400Hz( std::vector<uint8_t> &bytes )
+void write_wav_2400Hz( std::vector<uint8_t> &bytes, double rate = RATE )
 {  
-    write_wav_freq( 2415, 2.484/1000, bytes );
+    write_wav_freq( 2415, 2.484/1000, bytes, rate );
 }
 
-void write_wav_3700Hz( std::vector<uint8_t> &bytes )
+void write_wav_3700Hz( std::vector<uint8_t> &bytes, double rate = RATE )
 {  
-    write_wav_freq( 3623, 2.484/1000, bytes );
+    write_wav_freq( 3623, 2.484/1000, bytes, rate );
 }
 
-void write_wav_bit( bool bit, std::vector<uint8_t> &bytes )
+void write_wav_bit( bool bit, std::vector<uint8_t> &bytes, double rate = RATE )
 {
-    write_wav_3700Hz( bytes );
+    write_wav_3700Hz( bytes, rate );
     if (bit)
-        write_wav_2400Hz( bytes );
+        write_wav_2400Hz( bytes, rate );
     else
-        write_wav_3700Hz( bytes );
-    write_wav_2400Hz( bytes );
+        write_wav_3700Hz( bytes, rate );
+    write_wav_2400Hz( bytes, rate );
 }
 
-void write_wav_header( size_t size )
+void write_wav_header( size_t size, writer &out )
 {
     // WAV file header
     char chunkId[4] = {'R', 'I', 'F', 'F'};
@@ -707,23 +1341,23 @@ void write_wav_header( size_t size )
     char subchunk2Id[4] = {'d', 'a', 't', 'a'};
     uint32_t subchunk2Size = size; // The number of bytes in the data
 
-    // Write the header to stdout
-    fwrite(chunkId, sizeof(char), 4, stdout);
-    fwrite(&chunkSize, sizeof(uint32_t), 1, stdout);
-    fwrite(format, sizeof(char), 4, stdout);
-    fwrite(subchunk1Id, sizeof(char), 4, stdout);
-    fwrite(&subchunk1Size, sizeof(uint32_t), 1, stdout);
-    fwrite(&audioFormat, sizeof(uint16_t), 1, stdout);
-    fwrite(&numChannels, sizeof(uint16_t), 1, stdout);
-    fwrite(&sampleRate, sizeof(uint32_t), 1, stdout);
-    fwrite(&byteRate, sizeof(uint32_t), 1, stdout);
-    fwrite(&blockAlign, sizeof(uint16_t), 1, stdout);
-    fwrite(&bitsPerSample, sizeof(uint16_t), 1, stdout);
-    fwrite(subchunk2Id, sizeof(char), 4, stdout);
-    fwrite(&subchunk2Size, sizeof(uint32_t), 1, stdout);
+    // Write the header
+    out.write(chunkId, 4);
+    out.write(&chunkSize, sizeof(uint32_t));
+    out.write(format, 4);
+    out.write(subchunk1Id, 4);
+    out.write(&subchunk1Size, sizeof(uint32_t));
+    out.write(&audioFormat, sizeof(uint16_t));
+    out.write(&numChannels, sizeof(uint16_t));
+    out.write(&sampleRate, sizeof(uint32_t));
+    out.write(&byteRate, sizeof(uint32_t));
+    out.write(&blockAlign, sizeof(uint16_t));
+    out.write(&bitsPerSample, sizeof(uint16_t));
+    out.write(subchunk2Id, 4);
+    out.write(&subchunk2Size, sizeof(uint32_t));
 }
 
-bool write_wav( const kim_data &kd )
+bool write_wav( const kim_data &kd, writer &out )
 {
     fprintf( stderr, "Writing KIM-1 tape WAV for ID=%02X ADRS=%04X CHKSUM=%04X\n", (int)kd.id, (int)kd.adrs, (int)kd.compute_checksum() );
 
@@ -742,32 +1376,41 @@ bool write_wav( const kim_data &kd )
     write_wav_silence( bytes );
     write_wav_silence( bytes );
 
-    write_wav_header( bytes.size() );
-    return fwrite( bytes.data(), bytes.size(), 1, stdout )==1;
+    write_wav_header( bytes.size(), out );
+    out.write( bytes.data(), bytes.size() );
+    return out.flush();
 }
 
-bool kim_data_from_bits( const std::vector<bool> &encoded, kim_data &result )
+/// @brief Finds the first '*' that follows a run of SYN characters
+/// @return the position of the first data bit (just after the '*'), or e if none
+template <class I>
+I find_data_start( I b, I e )
 {
-    //  Find first 'on' bit
-    auto b = std::begin(encoded);
-    auto e = std::end(encoded);
+    while (true)
+    {
+        //  Lookup for SYN ('00010110')
+        b = find_bits( b,e, { false, true, true, false, true, false, false, false } );
 
-loop:
-    //  Lookup for SYN ('00010110')
-    b = find_bits( b,e, { false, true, true, false, true, false, false, false } );
+        if (b==e)
+            return e; //  No on bits left
 
-    if (b==e)
-        return false; //  No on bits left
-    
-    //  Scan by 8 until zero found
-    while (compare_bits( b, e, { false, true, true, false, true, false, false, false } ))
-            b += 8;
+        //  Scan by 8 until zero found
+        while (compare_bits( b, e, { false, true, true, false, true, false, false, false } ))
+                b += 8;
 
-    //  check for '*' ('00101010')
-    if (!compare_bits( b, e, { false, true, false, true, false, true, false, false } ))
-        goto loop;  //  evil
+        //  check for '*' ('00101010')
+        if (compare_bits( b, e, { false, true, false, true, false, true, false, false } ))
+            return b+8;
+    }
+}
+
+bool kim_data_from_bits( const std::vector<bool> &encoded, kim_data &result )
+{
+    auto e = std::end(encoded);
+    auto b = find_data_start( std::begin(encoded), e );
 
-    b += 8;
+    if (b==e)
+        return false;
 
     //  We are at the start of the data
 
@@ -846,167 +1489,3624 @@ loop:
     return true;
 }
 
-bool dump_bitstream = false;
-
-bool dump_bytestream = false;
-int dump_bytestream_offset = 0;
+/// @brief Check if the character at pos can be c, unknown bits matching anything
+/// @return the number of unknown bits in the character, or -1 if it cannot be c
+int char_matches( const std::vector<bool> &bits, const std::vector<bool> &error, size_t pos, uint8_t c )
+{
+    if (pos+8>bits.size())
+        return -1;
+    int unknown = 0;
+    for (size_t i=0;i!=8;i++)
+        if (error[pos+i])
+            unknown++;
+        else if (bits[pos+i]!=((c>>i)&1))
+            return -1;
+    return unknown;
+}
 
-void parse( const std::vector<sample_t> data, std::string patch )
+/// @brief Same as find_data_start, but tolerant to unknown bits: looks for a '*' with at most 2 unknown bits right after a SYN
+/// (like the exact one, a damaged SYN earlier in the leader doesn't matter)
+/// @param from first data bit to consider, to look for the next start after one
+/// @return the index of the first data bit, or bits.size() if none
+size_t find_data_start( const std::vector<bool> &bits, const std::vector<bool> &error, size_t from = 16 )
 {
-    std::vector<kim_data> matches;
-    Parser p;
-    for (auto s:data)
-        p.add( s );
+    for (size_t p=std::max( from, (size_t)16 )-8;p+8<=bits.size();p++)
+    {
+        int star = char_matches( bits, error, p, '*' );
+        if (star>=0 && star<=2 && char_matches( bits, error, p-8, 0x16 )>=0)
+            return p+8;
+    }
+    return bits.size();
+}
 
-    // for (int i=0;i!=8;i++)
-    // {
-    //     std::cout << "\n\n\n------------------------------------- " << i << "\n\n\n";
-    //     std::cout << string_from_bits( p.result, i );
-    // }
+/// @brief Value of an ASCII hex digit, or -1 if not an hex digit
+int hex_value( uint8_t c )
+{
+    if (c>='0' && c<='9')
+        return c-'0';
+    if (c>='A' && c<='F')
+        return c-'A'+10;
+    return -1;
+}
 
-    // auto start = kim_data_from_bits( p.result );
+/// @brief All the hex digits the character at pos can be, unknown bits matching anything
+std::vector<uint8_t> hex_options( const std::vector<bool> &bits, const std::vector<bool> &error, size_t pos )
+{
+    std::vector<uint8_t> result;
+    if (pos+8>bits.size())
+        return result;
 
-    auto bs =p.get_bitstream();
-    // std::cout << bs.fix_count() << "\n";
+    uint8_t known = 0;
+    std::vector<int> unknown;
+    for (int i=0;i!=8;i++)
+        if (error[pos+i])
+            unknown.push_back( i );
+        else if (bits[pos+i])
+            known |= 1<<i;
+
+    for (size_t fix=0;fix!=(size_t)1<<unknown.size();fix++)
+    {
+        uint8_t c = known;
+        for (size_t i=0;i!=unknown.size();i++)
+            if (fix&((size_t)1<<i))
+                c |= 1<<unknown[i];
+        int v = hex_value( c );
+        if (v>=0)
+            result.push_back( v );
+    }
+    return result;
+}
+
+/// @brief Position of a KIM-1 record in a bitstream. The checksum is after the '/', the EOT is 40 bits after the '/'
+struct kim_frame
+{
+    size_t data;        //  First bit after the '*'
+    size_t slash;       //  First bit of the '/'
+};
+
+/// @brief Adds the possible record positions after the '*' that ends at data
+void add_frames( const std::vector<bool> &bits, const std::vector<bool> &error, size_t data, std::vector<kim_frame> &result )
+{
+        //  At least ID and address, then '/', 4 checksum digits and EOT
+    for (size_t p=data;p+48<=bits.size();p+=8)
+    {
+        if ((p-data)%16==0 && p-data>=48 &&
+            char_matches( bits, error, p, '/' )>=0 && char_matches( bits, error, p+40, 0x04 )>=0)
+        {
+            bool hex = true;
+            for (size_t i=1;i<=4;i++)
+                if (hex_options( bits, error, p+8*i ).size()==0)
+                    hex = false;
+            if (hex)
+                result.push_back( { data, p } );
+        }
+
+            //  Everything before the '/' must be hex
+        if (hex_options( bits, error, p ).size()==0)
+            break;
+    }
+}
+
+/// @brief Finds all the possible record positions, unknown bits matching anything. They all start after the first '*'
+/// that gives at least one
+std::vector<kim_frame> find_frames( const std::vector<bool> &bits, const std::vector<bool> &error )
+{
+    std::vector<kim_frame> result;
+    for (size_t data=find_data_start( bits, error );result.empty() && data<bits.size();data=find_data_start( bits, error, data+1 ))
+        add_frames( bits, error, data, result );
+    return result;
+}
+
+/// @brief Re-frames a record damaged by slipped bits, a lost bit or a spurious one shifting all the characters after it.
+/// Dynamic programming over the bit positions after the '*': each character takes 7, 8 or 9 bits, and must be a hex digit
+/// (an even count of at least 6), then '/', 4 hex digits and EOT. A slip costs more than a wrong bit, and unknown bits are free,
+/// so the cheapest path is the one with the least damage. Each position is only reached from 3 positions, so this is linear.
+/// The characters are rebuilt on 8 bits. Bits that the possible characters disagree on, or that contradict them, become unknown
+class framer
+{
+    static constexpr int SLIP = 3;          //  Cost of a character on 7 or 9 bits
+    static constexpr int FLIP = 2;          //  Cost of a known bit that contradicts the character
+    static constexpr int MAX_COST = 6;      //  Above this, a character doesn't match at all
+    static constexpr int INF = INT32_MAX/2;
+
+        //  States: hex digits read before the '/' (0-5, then 6 even and 7 odd), the 4 checksum digits, and the end
+    enum { kData0 = 0, kDataEven = 6, kDataOdd = 7, kCheck0 = 8, kEnd = 13, kStates = 14 };
+
+    const std::vector<bool> &bits_;
+    const std::vector<bool> &error_;
+
+public:
+    /// @brief Best reading of the character on the len bits at pos
+    struct reading
+    {
+        int cost = INF;
+        uint8_t value = 0;
+        uint8_t unknown = 0;        //  Bits of value we are not sure of
+    };
+
+    framer( const std::vector<bool> &bits, const std::vector<bool> &error ) : bits_{ bits }, error_{ error }
+    {
+    }
+
+        //  The chars can be any of the candidates (hex digits, '/' or EOT)
+    reading read( size_t pos, size_t len, const char *candidates ) const
+    {
+        reading result;
+        if (pos+len>bits_.size())
+            return result;
+
+        uint8_t agree = 0xff;       //  Bits on which all the cheapest readings agree, and are not contradicted
+        for (;*candidates;candidates++)
+        {
+            uint8_t c = *candidates;
+                //  A lost bit may be anywhere in the 8, a spurious one anywhere in the 9
+            size_t variants = len==8?1:len==7?8:9;
+            for (size_t v=0;v!=variants;v++)
+            {
+                int cost = len==8?0:SLIP;
+                uint8_t doubt = 0;
+                for (size_t i=0;i!=8;i++)
+                {
+                    size_t src = len==9 ? i+(i>=v) : len==7 ? i-(i>v) : i;
+                    if (len==7 && i==v)
+                        doubt |= 1<<i;
+                    else if (error_[pos+src])
+                        doubt |= 1<<i;
+                    else if (bits_[pos+src]!=((c>>i)&1))
+                    {
+                        cost += FLIP;
+                        doubt |= 1<<i;
+                    }
+                }
+                if (cost>MAX_COST || cost>result.cost)
+                    continue;
+                if (cost<result.cost)
+                {
+                    result.cost = cost;
+                    result.value = c;
+                    agree = ~doubt;
+                }
+                else
+                    agree &= ~(doubt | (c^result.value));
+            }
+        }
+        result.unknown = ~agree;
+        return result;
+    }
+
+    /// @brief Finds the cheapest framing of the record starting at data
+    /// @param bits receives the record (from data) rebuilt on 8 bits per character, error its unknown bits
+    /// @param origin receives, for each rebuilt bit, the index of the source bit it comes from
+    /// @param end receives the index of the first source bit after the EOT
+    /// @return the number of slipped characters, or -1 if no framing was found
+    int align( size_t data, std::vector<bool> &bits, std::vector<bool> &error, std::vector<size_t> &origin, size_t &end ) const
+    {
+        static const char *hex = "0123456789ABCDEF";
+        static const char slash[] = { '/', 0 };
+        static const char eot[] = { 0x04, 0 };
+
+        size_t n = bits_.size()-data+1;
+
+            //  The tables grow with the positions reached, so only the framed record is allocated, not the whole tail
+        std::vector<int> cost;
+        std::vector<uint32_t> from;                         //  Previous position<<4 | previous state
+        auto reach = [&]( size_t q )
+        {
+            if (cost.size()<(q+1)*kStates)
+            {
+                cost.resize( (q+1)*kStates, INF );
+                from.resize( (q+1)*kStates, 0 );
+            }
+        };
+        reach( 0 );
+        cost[kData0] = 0;
+
+        auto relax = [&]( size_t p, int s, size_t q, int t, int c )
+        {
+            if (q<n && cost[p*kStates+s]+c<cost[q*kStates+t])
+            {
+                cost[q*kStates+t] = cost[p*kStates+s]+c;
+                from[q*kStates+t] = (uint32_t)(p<<4 | s);
+            }
+        };
+
+        int end_cost = INF;
+        for (size_t p=0;p!=n;p++)
+        {
+            reach( std::min( p+9, n-1 ) );
+
+                //  Costs only grow along a path: once nothing reachable is cheaper than an end we have, we are done
+            int live = INF;
+            for (size_t q=p;q!=std::min( p+10, n );q++)
+                for (int s=kData0;s!=kEnd;s++)
+                    live = std::min( live, cost[q*kStates+s] );
+            if (live>=end_cost)
+                break;
+
+            for (size_t len=7;len<=9;len++)
+            {
+                    //  Only read the character if some state can use it
+                bool data_state = false, check_state = false;
+                for (int s=kData0;s<=kDataOdd;s++)
+                    data_state |= cost[p*kStates+s]<INF;
+                for (int s=kCheck0;s<kCheck0+4;s++)
+                    check_state |= cost[p*kStates+s]<INF;
+
+                if (data_state || check_state)
+                {
+                    auto r = read( data+p, len, hex );
+                    if (r.cost<INF)
+                    {
+                        for (int s=kData0;s<=kDataOdd;s++)
+                            relax( p, s, p+len, s==kDataOdd?kDataEven:s+1, r.cost );
+                        for (int s=kCheck0;s<kCheck0+4;s++)
+                            relax( p, s, p+len, s+1, r.cost );
+                    }
+                }
+                if (cost[p*kStates+kDataEven]<INF)
+                {
+                    auto r = read( data+p, len, slash );
+                    if (r.cost<INF)
+                        relax( p, kDataEven, p+len, kCheck0, r.cost );
+                }
+                if (cost[p*kStates+kCheck0+4]<INF)
+                {
+                    auto r = read( data+p, len, eot );
+                    if (r.cost<INF)
+                    {
+                        relax( p, kCheck0+4, p+len, kEnd, r.cost );
+                        if (p+len<n)
+                            end_cost = std::min( end_cost, cost[(p+len)*kStates+kEnd] );
+                    }
+                }
+            }
+        }
+
+            //  Cheapest end (the earliest one on ties)
+        size_t reached = cost.size()/kStates;
+        size_t best = reached;
+        for (size_t p=0;p!=reached;p++)
+            if (cost[p*kStates+kEnd]<INF && (best==reached || cost[p*kStates+kEnd]<cost[best*kStates+kEnd]))
+                best = p;
+        if (best==reached)
+            return -1;
+
+            //  Walks back the path
+        std::vector<std::pair<size_t,int>> path;
+        for (size_t p=best, s=kEnd;p!=0 || s!=kData0;)
+        {
+            path.push_back( { p, (int)s } );
+            uint32_t f = from[p*kStates+s];
+            p = f>>4;
+            s = f&15;
+        }
+        std::reverse( std::begin(path), std::end(path) );
+
+        int slips = 0;
+        size_t p = 0;
+        for (auto &step:path)
+        {
+            size_t len = step.first-p;
+            int s = step.second;
+            auto r = read( data+p, len, s==kCheck0?slash:s==kEnd?eot:hex );
+            slips += len!=8;
+            for (size_t i=0;i!=8;i++)
+            {
+                bits.push_back( (r.value>>i)&1 );
+                error.push_back( (r.unknown>>i)&1 );
+                origin.push_back( data+p+std::min( i, len-1 ) );
+            }
+            p = step.first;
+        }
+        end = data+best;
+        return slips;
+    }
+};
+
+/// @brief When no record can be framed, rebuilds it with the framer (see there), keeping the leader and what follows the EOT.
+/// Unknown bits keep their timestamp, new ones get the one of the bit they come from (or, without times, the one of the
+/// closest unknown bit, moved by the bit distance)
+/// @param report display the result
+/// @param times timestamp of each bit of bs in the source (see demodulated::bit_times), or empty
+/// @return false if the bitstream was left unchanged
+bool realign( bitstream &bs, bool report = true, const std::vector<double> &times = {} )
+{
+    const auto &bits = bs.raw_bits();
+    auto error = bs.error_mask();
+    if (!find_frames( bits, error ).empty())
+        return false;
+    size_t data = find_data_start( bits, error );
+    if (data>=bits.size())
+        return false;
+
+    std::vector<bool> record, record_error;
+    std::vector<size_t> origin;
+    size_t end;
+    int slips = framer{ bits, error }.align( data, record, record_error, origin, end );
+    if (slips<=0)
+        return false;
+
+    std::vector<bool> result( std::begin(bits), std::begin(bits)+data );
+    std::vector<size_t> result_origin( data );
+    for (size_t i=0;i!=data;i++)
+        result_origin[i] = i;
+    std::vector<bool> result_error( std::begin(error), std::begin(error)+data );
+    result.insert( std::end(result), std::begin(record), std::end(record) );
+    result_error.insert( std::end(result_error), std::begin(record_error), std::end(record_error) );
+    result_origin.insert( std::end(result_origin), std::begin(origin), std::end(origin) );
+    for (size_t i=end;i<bits.size();i++)
+    {
+        result.push_back( bits[i] );
+        result_error.push_back( error[i] );
+        result_origin.push_back( i );
+    }
+
+    std::vector<fix_t> fixes;
+    const auto &errors = bs.errors();
+    for (size_t i=0;i!=result.size();i++)
+        if (result_error[i])
+        {
+            size_t o = result_origin[i];
+            auto closest = std::min_element( std::begin(errors), std::end(errors), [&]( const fix_t &a, const fix_t &b )
+                { return std::abs( (double)a.bit_location-o )<std::abs( (double)b.bit_location-o ); } );
+            double ts;
+            if (closest!=std::end(errors) && closest->bit_location==o)
+                ts = closest->source_ts;
+            else if (o<times.size())
+                ts = times[o];
+            else
+                ts = closest==std::end(errors) ? 0 : closest->source_ts+((double)o-closest->bit_location)*BIT_DURATION;
+            fixes.push_back( { i, ts } );
+        }
+
+    if (report)
+        std::clog << "No record frame, realigned " << slips << " slipped characters: " << bs.error_count() << " -> " << fixes.size() << " unknown bits\n";
+    bs = bitstream{ result, fixes };
+    return true;
+}
+
+
+/// @brief Finds the ways to fill the unknown bits of a record so it is only hex digits with a correct checksum.
+/// The checksum is a sum, so each digit contributes independently to it. Digits with several possible values are split
+/// in two halves. All the partial sums of the first half are bucketed by value, then each combination of the second half
+/// is joined with the bucket that completes the checksum (meet-in-the-middle), which is about sqrt(N) work for N combinations.
+/// @param found called for each record found
+/// @param report display the size of the problem
+/// @param deadline maximum duration of the search in seconds (0: no limit), the records found until then are kept
+/// @return false if the search space is too large
+template <class F>
+bool solve_checksum( const bitstream &bs, F found, bool report = true, double deadline = 0 )
+{
+    static const size_t MAX_HALF = (size_t)1<<24;     //  Combinations for each half
+    static const size_t MAX_SOLUTIONS = 256;
+
+    auto &bits = bs.raw_bits();
+    auto error = bs.error_mask();
+
+    auto start = std::chrono::steady_clock::now();
+    bool stopped = false;
+    auto check_deadline = [&]
+    {
+        if (deadline>0 && std::chrono::duration<double>( std::chrono::steady_clock::now()-start ).count()>=deadline)
+            stopped = true;
+        return stopped;
+    };
+
+    auto frames = find_frames( bits, error );
+    if (frames.empty() && report)
+        std::clog << "Checksum solver: no record frame found\n";
+
+    for (auto frame:frames)
+    {
+        if (stopped)
+            break;
+
+        struct digit_t
+        {
+            uint16_t weight;                //  Multiplier of the digit in the checksum equation (mod 65536)
+            std::vector<uint8_t> values;
+        };
+        std::vector<digit_t> digits;
+
+            //  Data digits, the ID byte (first 2 digits) is not in the checksum
+        size_t data_digits = (frame.slash-frame.data)/8;
+        for (size_t c=0;c!=data_digits;c++)
+            digits.push_back( { (uint16_t)(c<2?0:(c%2==0?16:1)), hex_options( bits, error, frame.data+8*c ) } );
+
+            //  Checksum digits, low byte first, subtracted
+        for (uint16_t w:{ 16, 1, 4096, 256 })
+            digits.push_back( { (uint16_t)-w, hex_options( bits, error, frame.slash+8*(digits.size()-data_digits+1) ) } );
+
+        uint16_t constant = 0;
+        std::vector<size_t> vars;
+        bool valid = true;
+        for (size_t i=0;i!=digits.size();i++)
+            if (digits[i].values.size()==0)
+                valid = false;
+            else if (digits[i].values.size()==1)
+                constant += digits[i].weight*digits[i].values[0];
+            else
+                vars.push_back( i );
+        if (!valid)
+            continue;
+
+            //  Split vars in two halves of similar combination counts, largest first
+        std::sort( std::begin(vars), std::end(vars), [&]( size_t a, size_t b ) { return digits[a].values.size()>digits[b].values.size(); } );
+        std::vector<size_t> half[2];
+        double log_count[2] = { 0, 0 };
+        for (auto v:vars)
+        {
+            int h = log_count[0]<=log_count[1]?0:1;
+            half[h].push_back( v );
+            log_count[h] += ::log2( digits[v].values.size() );
+        }
+        if (log_count[0]>::log2( MAX_HALF ) || log_count[1]>::log2( MAX_HALF ))
+        {
+            if (report)
+                std::clog << "Checksum solver: " << vars.size() << " unknown digits, too many combinations\n";
+            return false;
+        }
+
+        if (report)
+            std::clog << "Checksum solver: " << vars.size() << " unknown digits, 2^" << (int)(log_count[0]+log_count[1]+0.5) << " combinations\n";
+
+            //  Enumerates the combinations of a half, in mixed radix order, calling f( index, choices, sum )
+        auto enumerate = [&]( const std::vector<size_t> &h, auto f )
+        {
+            std::vector<size_t> choice( h.size(), 0 );
+            uint16_t sum = 0;
+            for (auto v:h)
+                sum += digits[v].weight*digits[v].values[0];
+            for (size_t index=0;;index++)
+            {
+                    //  Look at the clock every 4K combinations
+                if ((index&0xfff)==0xfff && check_deadline())
+                    return;
+                f( index, choice, sum );
+                size_t i = 0;
+                for (;i!=h.size();i++)
+                {
+                    auto &d = digits[h[i]];
+                    sum -= d.weight*d.values[choice[i]];
+                    if (++choice[i]==d.values.size())
+                        choice[i] = 0;
+                    sum += d.weight*d.values[choice[i]];
+                    if (choice[i]!=0)
+                        break;
+                }
+                if (i==h.size())
+                    return;
+            }
+        };
+
+            //  Bucket the sums of the first half (counting sort on the 16 bits value)
+        std::vector<uint16_t> sums;
+        enumerate( half[0], [&]( size_t, const std::vector<size_t> &, uint16_t sum ) { sums.push_back( sum ); } );
+        if (stopped)
+            break;
+        std::vector<uint32_t> bucket( 65536+1, 0 );
+        for (auto s:sums)
+            bucket[s+1]++;
+        for (size_t i=1;i!=bucket.size();i++)
+            bucket[i] += bucket[i-1];
+        std::vector<uint32_t> order( sums.size() );
+        {
+            auto next = bucket;
+            for (size_t i=0;i!=sums.size();i++)
+                order[next[sums[i]]++] = i;
+        }
+
+            //  Join with the second half
+        size_t solutions = 0;
+        enumerate( half[1], [&]( size_t, const std::vector<size_t> &choice, uint16_t sum )
+        {
+            uint16_t need = -(uint16_t)(constant+sum);
+            for (auto k=bucket[need];k!=bucket[need+1] && solutions<MAX_SOLUTIONS;k++)
+            {
+                    //  Rebuild the digits
+                std::vector<uint8_t> value( digits.size() );
+                for (size_t i=0;i!=digits.size();i++)
+                    value[i] = digits[i].values[0];
+                size_t index = order[k];
+                for (auto v:half[0])
+                {
+                    value[v] = digits[v].values[index%digits[v].values.size()];
+                    index /= digits[v].values.size();
+                }
+                for (size_t i=0;i!=half[1].size();i++)
+                    value[half[1][i]] = digits[half[1][i]].values[choice[i]];
+
+                kim_data kd;
+                for (size_t c=0;c<data_digits;c+=2)
+                    kd.data.push_back( value[c]*16+value[c+1] );
+                kd.id = kd.data[0];
+                kd.adrs = kd.data[1]+((uint16_t)kd.data[2])*256;
+                kd.checksum = value[data_digits]*16+value[data_digits+1]+(value[data_digits+2]*16+value[data_digits+3])*256;
+                assert( kd.compute_checksum()==kd.checksum );
+                found( kd );
+                solutions++;
+            }
+        } );
+
+        if (report && solutions==MAX_SOLUTIONS)
+            std::clog << "Checksum solver: stopped after " << MAX_SOLUTIONS << " solutions\n";
+    }
+
+    if (report && stopped)
+        std::clog << "Checksum solver: deadline reached\n";
+    return true;
+}
+
+/// @brief Bit-sliced evaluation of a record: 64 combinations of the unknown bits are checked at once, one per bit of an
+/// uint64_t (a lane). Combination fix gives bit i the value of bit i of fix, so in a word of 64 consecutive combinations
+/// the 6 first unknown bits follow fixed patterns and the others are constant.
+/// Each character that has unknown bits is checked and decoded with boolean logic, the checksum is summed with a
+/// bit-sliced ripple adder. Characters without unknown bits are checked and summed once, at construction.
+class sliced_evaluator
+{
+    typedef uint64_t lanes_t;
+
+    struct bit_t
+    {
+        int unknown;        //  Index of the unknown bit, or -1
+        bool value;         //  Value, if known
+    };
+
+    struct char_t
+    {
+        bit_t bits[8];
+        int shift;          //  Position of the nibble in the 16 bits sum (-1 if not summed)
+        bool checksum;      //  Part of the stored checksum, instead of the data
+        int expected;       //  For markers, the expected character, -1 for hex digits
+    };
+
+    std::vector<char_t> chars_;     //  Only characters with unknown bits
+    uint16_t constant_ = 0;         //  Sum of the known data digits minus the known checksum digits
+    bool valid_ = true;             //  False if a known character is wrong
+
+    static lanes_t pattern( int unknown, size_t base )
+    {
+        static const lanes_t patterns[6] = {
+            0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+            0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL };
+        if (unknown<6)
+            return patterns[unknown];
+        return (base>>unknown)&1?~(lanes_t)0:0;
+    }
+
+        //  Bit-sliced acc += nibble<<shift
+    static void add( lanes_t acc[16], const lanes_t nibble[4], int shift )
+    {
+        lanes_t carry = 0;
+        for (int k=shift;k!=16;k++)
+        {
+            lanes_t x = k-shift<4?nibble[k-shift]:0;
+            lanes_t sum = acc[k]^x^carry;
+            carry = (acc[k]&x)|(carry&(acc[k]^x));
+            acc[k] = sum;
+        }
+    }
+
+    void add_char( const std::vector<bool> &bits, const std::vector<int> &unknown, size_t pos, int shift, bool checksum, int expected )
+    {
+        char_t c{ {}, shift, checksum, expected };
+        uint8_t known = 0;
+        bool damaged = false;
+        for (int i=0;i!=8;i++)
+        {
+            c.bits[i] = { unknown[pos+i], bits[pos+i] };
+            if (unknown[pos+i]>=0)
+                damaged = true;
+            else if (bits[pos+i])
+                known |= 1<<i;
+        }
+
+        if (damaged)
+        {
+            chars_.push_back( c );
+            return;
+        }
+
+        if (expected>=0)
+        {
+            if (known!=expected)
+                valid_ = false;
+            return;
+        }
+        int v = hex_value( known );
+        if (v<0)
+            valid_ = false;
+        else if (shift>=0)
+            constant_ += (checksum?-1:1)*(v<<shift);
+    }
+
+public:
+    sliced_evaluator( const bitstream &bs, const kim_frame &frame )
+    {
+        auto &bits = bs.raw_bits();
+        std::vector<int> unknown( bits.size(), -1 );
+        for (size_t i=0;i!=bs.errors().size();i++)
+            unknown[bs.errors()[i].bit_location] = i;
+
+        size_t data_digits = (frame.slash-frame.data)/8;
+        for (size_t c=0;c!=data_digits;c++)
+            add_char( bits, unknown, frame.data+8*c, c<2?-1:(c%2==0?4:0), false, -1 );
+        add_char( bits, unknown, frame.slash, -1, false, '/' );
+        int shifts[4] = { 4, 0, 12, 8 };
+        for (size_t c=0;c!=4;c++)
+            add_char( bits, unknown, frame.slash+8+8*c, shifts[c], true, -1 );
+        add_char( bits, unknown, frame.slash+40, -1, false, 0x04 );
+    }
+
+    /// @brief Evaluates the 64 combinations base..base+63 (base must be a multiple of 64)
+    /// @return the lanes that give a valid record with a correct checksum
+    uint64_t evaluate( size_t base ) const
+    {
+        if (!valid_)
+            return 0;
+
+        lanes_t valid = ~(lanes_t)0;
+        lanes_t sum[16], checksum[16];
+        for (int k=0;k!=16;k++)
+        {
+            sum[k] = (constant_>>k)&1?~(lanes_t)0:0;
+            checksum[k] = 0;
+        }
+
+        for (auto &c:chars_)
+        {
+            lanes_t b[8];
+            for (int i=0;i!=8;i++)
+                b[i] = c.bits[i].unknown>=0?pattern( c.bits[i].unknown, base ):(c.bits[i].value?~(lanes_t)0:0);
+
+            if (c.expected>=0)
+            {
+                for (int i=0;i!=8;i++)
+                    valid &= (c.expected>>i)&1?b[i]:~b[i];
+                continue;
+            }
+
+                //  '0'-'9' is 0011xxxx with xxxx<=9, 'A'-'F' is 01000xxx with xxx in 1..6
+            lanes_t digit = ~b[7]&~b[6]&b[5]&b[4]&~(b[3]&(b[2]|b[1]));
+            lanes_t letter = ~b[7]&b[6]&~b[5]&~b[4]&~b[3]&(b[2]|b[1]|b[0])&~(b[2]&b[1]&b[0]);
+            valid &= digit|letter;
+
+            if (c.shift<0)
+                continue;
+
+                //  Letters are xxx+9: 1010 to 1111
+            lanes_t nibble[4];
+            lanes_t l[4] = { ~b[0], b[0]^b[1], b[2]|(b[1]&b[0]), ~(lanes_t)0 };
+            for (int i=0;i!=4;i++)
+                nibble[i] = (b[6]&l[i])|(~b[6]&b[i]);
+
+            if (c.checksum)
+                for (int i=0;i!=4;i++)
+                    checksum[c.shift+i] |= nibble[i];
+            else
+                add( sum, nibble, c.shift );
+        }
+
+            //  The known checksum digits are already subtracted from the constant
+        for (int k=0;k!=16;k++)
+            valid &= ~(sum[k]^checksum[k]);
+
+        return valid;
+    }
+};
+
+/// @brief Record with ID 01 loaded at 0200, for the tests
+kim_data test_record( std::vector<uint8_t> payload )
+{
+    kim_data kd;
+    kd.id = 0x01;
+    kd.adrs = 0x0200;
+    kd.data = { kd.id, (uint8_t)kd.adrs, (uint8_t)(kd.adrs>>8) };
+    kd.data.insert( std::end(kd.data), std::begin(payload), std::end(payload) );
+    kd.checksum = kd.compute_checksum();
+    return kd;
+}
+
+//  Tests for the checksum solver
+void test_solver()
+{
+    auto kd = test_record( { 0x12, 0x34, 0xAB, 0xCD } );
+
+    auto bits = kim_encode_bits( kd );
+    std::vector<fix_t> errors;
+    for (size_t b:{ 801, 812, 822, 834, 843, 850, 867, 877, 885 })    //  In the '*' and the data digits
+        errors.push_back( { b, 0 } );
+    bitstream bs{ bits, errors };
+
+    bool solved = false;
+    bool complete = solve_checksum( bs, [&]( const kim_data &k ) { if (k==kd) solved = true; }, false );
+    assert( complete && solved );
+
+        //  Above ENUMERATION_LIMIT: one unknown bit in each of the 14 data digits and of the 4 checksum digits
+    errors.clear();
+    for (size_t c=0;c!=14+4;c++)
+        errors.push_back( { (c<14?808+8*c:928+8*(c-14))+c%2, 0 } );
+    bs = bitstream{ bits, errors };
+    solved = false;
+    complete = solve_checksum( bs, [&]( const kim_data &k ) { if (k==kd) solved = true; }, false );
+    assert( complete && solved );
+
+        //  A corrupted SYN before the last one, that used to leave no frame
+    bits[98*8+3] = !bits[98*8+3];
+    bs = bitstream{ bits, errors };
+    solved = false;
+    complete = solve_checksum( bs, [&]( const kim_data &k ) { if (k==kd) solved = true; }, false );
+    assert( complete && solved );
+    (void)complete;
+}
+
+//  Tests for the bit-sliced evaluator, against the scalar decoding
+void test_sliced()
+{
+    auto kd = test_record( { 0x3C, 0xA5 } );
+
+    auto bits = kim_encode_bits( kd );
+    std::vector<fix_t> errors;
+    for (size_t b:{ 810, 820, 833, 845, 859, 867, 890, 900 })     //  In the data, '/' and checksum
+        errors.push_back( { b, 0 } );
+
+        //  As is, then with a corrupted SYN before the last one, that used to leave no frame
+    for (int pass=0;pass!=2;pass++)
+    {
+        if (pass==1)
+            bits[98*8+3] = !bits[98*8+3];
+        bitstream bs{ bits, errors };
+
+        auto frames = find_frames( bs.raw_bits(), bs.error_mask() );
+        assert( frames.size()==1 );
+        sliced_evaluator e{ bs, frames[0] };
+        for (size_t base=0;base<bs.fix_count();base+=64)
+        {
+            uint64_t lanes = e.evaluate( base );
+            for (size_t lane=0;lane!=64 && base+lane<bs.fix_count();lane++)
+            {
+                kim_data k;
+                assert( kim_data_from_bits( bs.bits( base+lane ), k )==(bool)((lanes>>lane)&1) );
+            }
+        }
+    }
+}
+
+void test_realign()
+{
+    auto kd = test_record( { 0x12, 0x34, 0xAB, 0xCD, 0x5E } );
+
+        //  A lost bit in the address, a spurious one in the data
+    auto bits = kim_encode_bits( kd );
+    bits.insert( std::begin(bits)+870, true );
+    bits.erase( std::begin(bits)+820 );
+    bitstream bs{ bits, {} };
+
+    assert( realign( bs, false ) );
+    assert( find_frames( bs.raw_bits(), bs.error_mask() ).size()>0 );
+    bool solved = false;
+    solve_checksum( bs, [&]( const kim_data &k ) { if (k==kd) solved = true; }, false );
+    assert( solved );
+
+        //  There were no unknown bits before: the new ones take the time of the bits they come from
+    std::vector<double> times( bits.size() );
+    for (size_t i=0;i!=bits.size();i++)
+        times[i] = 1+i*BIT_DURATION;
+    bitstream timed{ bits, {} };
+    assert( realign( timed, false, times ) && timed.error_count()>0 );
+    for (auto &f:timed.errors())
+        assert( std::abs( f.source_ts-times[f.bit_location] )<=2*BIT_DURATION );
+}
+
+bool dump_bitstream = false;
+
+    //  Above this number of unknown bits, the checksum solver is used instead of trying all the combinations
+const size_t ENUMERATION_LIMIT = 16;
+
+/// @brief Settings of the sample processing and of the search
+struct decode_options
+{
+    int smooth = 0;
+    int hysteresis = 0;             //  Half width of the crossing threshold band around MID (HYSTERESIS_AUTO: follows the signal amplitude)
+    double tolerance = 1;           //  Scale of the accepted pulse width deviation (1: a third of a 9 pulse)
+    size_t threads = 1;             //  Demodulation threads for a long take (see demodulate_chunked)
+    bool prescan = false;           //  Only demodulate the records found by prescan()
+    bool agc = false;
+    bool repair = false;
+    bool verify = false;            //  Settle unknown bits and rank the records by comparing them to the audio (see synthesis_verifier). Keeps the samples of the take
+    std::string search = "auto";    //  How to search for the unknown bits: auto, enumerate (try all combinations) or solve (checksum solver)
+    std::string patch;              //  Values for the unknown bits ('0', '1' or 'x' for each)
+    double deadline = 0;            //  Maximum duration of the enumeration or of the checksum solver in seconds (0: no limit)
+    std::string checkpoint;         //  File to save the enumeration progress to, and resume from
+};
+
+    //  Set by SIGINT during a checkpointed enumeration: the enumeration saves and stops, the records found so far are written, and we exit with a failure
+volatile sig_atomic_t interrupted = 0;
+
+/// @brief Identifies a bitstream, so a checkpoint is not resumed on another one (FNV-1a on bits and unknown bits)
+uint64_t signature( const bitstream &bs )
+{
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&]( uint64_t v ) { hash = (hash^v)*1099511628211ULL; };
+    for (auto b:bs.raw_bits())
+        mix( b );
+    for (auto &e:bs.errors())
+        mix( e.bit_location );
+    return hash;
+}
+
+/// @brief Enumeration state saved in a checkpoint file
+struct checkpoint_t
+{
+    uint64_t signature = 0;
+    size_t next = 0;                    //  First combination not yet evaluated
+    std::vector<size_t> matches;        //  Combinations that gave a record
+
+    bool load( const std::string &path )
+    {
+        std::ifstream f{ path };
+        std::string word;
+        if (!(f >> word) || word!="kimreader-checkpoint")
+            return false;
+        while (f >> word)
+        {
+            size_t value;
+            if (word=="signature")
+                f >> std::hex >> signature >> std::dec;
+            else if (word=="next")
+                f >> next;
+            else if (word=="match" && f >> value)
+                matches.push_back( value );
+        }
+        return true;
+    }
+
+        //  Written in a temporary file then renamed, so a kill never leaves a half written checkpoint
+    bool save( const std::string &path ) const
+    {
+        std::string tmp = path+".tmp";
+        {
+            std::ofstream f{ tmp };
+            f << "kimreader-checkpoint\nsignature " << std::hex << signature << std::dec << "\nnext " << next << "\n";
+            for (auto m:matches)
+                f << "match " << m << "\n";
+            if (!f)
+                return false;
+        }
+        return ::rename( tmp.c_str(), path.c_str() )==0;
+    }
+};
+
+/// @brief Tries all the combinations of unknown bits, 64 at a time through the bit-sliced evaluator.
+/// Displays its progress, stops at the deadline, and saves/resumes its progress in the checkpoint file.
+/// @param add_match called for each record found
+template <class F>
+void enumerate_fixes( const bitstream &bs, const decode_options &options, F add_match )
+{
+    typedef std::chrono::steady_clock clock;
+
+    std::vector<sliced_evaluator> evaluators;
+    for (auto &frame:find_frames( bs.raw_bits(), bs.error_mask() ))
+        evaluators.emplace_back( bs, frame );
+
+    size_t count = bs.fix_count();
+
+        //  The frames only narrow the search: without any, or for a single batch, every combination is decoded
+    bool plain = evaluators.empty() || count<=64;
+
+    checkpoint_t state;
+    state.signature = signature( bs );
+    if (options.checkpoint!="")
+    {
+        checkpoint_t saved;
+        if (saved.load( options.checkpoint ))
+        {
+            if (saved.signature==state.signature && saved.next<=count)
+            {
+                state = saved;
+                if (!quiet)
+                    std::clog << "Resuming from checkpoint at combination " << state.next << "\n";
+            }
+            else if (!quiet)
+                std::clog << "Checkpoint " << options.checkpoint << " is for another bitstream, ignored\n";
+        }
+        interrupted = 0;
+        ::signal( SIGINT, []( int ) { interrupted = 1; } );
+    }
+
+    auto save = [&]
+    {
+        if (!state.save( options.checkpoint ))
+            std::cerr << "Could not write checkpoint " << options.checkpoint << "\n";
+    };
+
+    size_t found = 0;
+    auto check = [&]( size_t fix )
+    {
+        auto bits = bs.bits( fix );
+        kim_data kd;
+        if (kim_data_from_bits( bits, kd ))
+        {
+            add_match( kd );
+            found++;
+            return true;
+        }
+        return false;
+    };
+
+    for (auto m:state.matches)
+        check( m );
+
+        //  we interate all the solutions, 64 at a time, and only fully decode the ones that look correct
+    if (!quiet)
+        std::clog << "Generating " << count << " combinations\n";
+
+    auto start = clock::now();
+    auto last_progress = start;
+    auto last_checkpoint = start;
+    size_t first = state.next;
+    bool stopped = false;
+
+    for (size_t base=state.next;base<count;base+=64)
+    {
+        uint64_t lanes = plain?~(uint64_t)0:0;
+        for (auto &e:evaluators)
+            lanes |= e.evaluate( base );
+        if (count-base<64)
+            lanes &= ((uint64_t)1<<(count-base))-1;
+        while (lanes)
+        {
+            int lane = __builtin_ctzll( lanes );
+            lanes &= lanes-1;
+            if (check( base+lane ))
+                state.matches.push_back( base+lane );
+        }
+        state.next = std::min( base+64, count );
+
+            //  Look at the clock every 4K combinations
+        if ((base&0xfff)!=0xfc0 && !interrupted)
+            continue;
+
+        auto now = clock::now();
+        double elapsed = std::chrono::duration<double>( now-start ).count();
+        if (!quiet && now-last_progress>=std::chrono::seconds( 1 ))
+        {
+            double rate = (state.next-first)/elapsed;
+            std::clog << "  " << std::fixed << std::setprecision( 1 ) << 100.0*state.next/count << "% "
+                      << state.next << "/" << count << ", "
+                      << std::setprecision( 0 ) << rate << " combinations/s, ETA " << from_duration( (count-state.next)/rate )
+                      << ", " << found << " matches\n" << std::defaultfloat;
+            last_progress = now;
+        }
+        if (options.checkpoint!="" && now-last_checkpoint>=std::chrono::seconds( 10 ))
+        {
+            save();
+            last_checkpoint = now;
+        }
+        if (interrupted || (options.deadline>0 && elapsed>=options.deadline))
+        {
+            stopped = true;
+            break;
+        }
+    }
+
+    if (options.checkpoint!="")
+    {
+        save();
+        ::signal( SIGINT, SIG_DFL );
+    }
+
+    if (stopped && !quiet)
+        std::clog << (interrupted?"Interrupted":"Deadline reached") << " after " << state.next << " of " << count
+                  << " combinations, " << found << " matches so far\n";
+}
+
+//  Tests for the enumeration, narrowed by the frames or not
+void test_enumerate()
+{
+    auto kd = test_record( { 0x3C, 0xA5 } );
+
+    auto bits = kim_encode_bits( kd );
+    bits[98*8+3] = !bits[98*8+3];       //  A corrupted SYN, the one before the last
+    auto solved = [&]( const std::vector<fix_t> &errors )
+    {
+        bitstream bs{ bits, errors };
+        bool found = false;
+        bool was_quiet = quiet;
+        quiet = true;
+        enumerate_fixes( bs, decode_options{}, [&]( const kim_data &k ) { if (k==kd) found = true; } );
+        quiet = was_quiet;
+        return found;
+    };
+    assert( solved( { { 810, 0 }, { 835, 0 }, { 859, 0 } } ) );
+
+        //  3 unknown bits in the '*' make no frame, all the combinations are decoded
+    bitstream bs{ bits, { { 801, 0 }, { 802, 0 }, { 803, 0 } } };
+    assert( find_frames( bs.raw_bits(), bs.error_mask() ).empty() );
+    assert( solved( bs.errors() ) );
+}
+
+/// @brief Analysis-by-synthesis check of the unknown bits against the audio. Around an unknown bit, the waveform of the bit
+/// and of its two neighbours is synthesized as write_wav() does, and matched against the samples at the timestamp of the bit
+/// by normalized cross-correlation (the best one, over half a segment of shift each way). Only these 3 bits are synthesized,
+/// and each of their 8 values is scored once per bitstream, so ranking many candidate records is cheap
+class synthesis_verifier
+{
+    static constexpr double SETTLE_MATCH = 0.5;     //  A value settles a bit if it matches at least this well...
+    static constexpr double SETTLE_MARGIN = 0.05;   //  ...and by that much more than the other value
+
+    const std::vector<sample_t> &samples_;
+    uint32_t rate_;
+    ptrdiff_t bit_;             //  Samples per bit
+    ptrdiff_t slack_;           //  Half a segment
+    std::vector<std::vector<int16_t>> waves_;   //  Centered waveform of each 3 bits value (bit before is the low bit)
+
+        //  Score of each value of the 3 bits around each unknown bit of the bitstream being checked (NAN: not computed yet)
+    std::vector<std::array<double,8>> cache_;
+
+        //  Best normalized cross-correlation of the wave with the samples that start around start.
+        //  The wave is a multiple of 16 samples, so the inner loop is vectorized by the compiler
+    double correlate( const std::vector<int16_t> &wave, ptrdiff_t start ) const
+    {
+        const ptrdiff_t n = wave.size();
+        int64_t wave_sum = 0;
+        int64_t wave_sq = 0;
+        for (auto w:wave)
+        {
+            wave_sum += w;
+            wave_sq += w*w;
+        }
+
+        double best = 0;
+        for (ptrdiff_t s=std::max( start-slack_, (ptrdiff_t)0 );s<=start+slack_ && s+n<=(ptrdiff_t)samples_.size();s++)
+        {
+            const sample_t *a = samples_.data()+s;
+            const int16_t *w = wave.data();
+            int32_t dot = 0;
+            int32_t sum = 0;
+            int32_t sq = 0;
+            for (ptrdiff_t i=0;i!=n;i+=16)
+                for (int j=0;j!=16;j++)
+                {
+                    int32_t v = a[i+j];
+                    dot += w[i+j]*v;
+                    sum += v;
+                    sq += v*v;
+                }
+            double cov = dot-(double)sum*wave_sum/n;
+            double var = sq-(double)sum*sum/n;
+            if (var>0)
+                best = std::max( best, cov/::sqrt( var*(wave_sq-(double)wave_sum*wave_sum/n) ) );
+        }
+        return best;
+    }
+
+        //  Score of the 3 bits around unknown bit #e having the given value
+    double score( const bitstream &bs, size_t e, int value )
+    {
+        auto &cached = cache_[e][value];
+        if (std::isnan( cached ))
+        {
+            ptrdiff_t start = bs.errors()[e].source_ts*rate_;
+            cached = correlate( waves_[value], start-bit_ );
+        }
+        return cached;
+    }
+
+        //  Bits of a record: the SYN leader and '*' before the data, then up to the EOT
+    static constexpr size_t LEADER_BITS = 101*8;
+
+        //  An unknown bit can be scored if it has two neighbours
+    bool scorable( const bitstream &bs, size_t e ) const
+    {
+        size_t p = bs.errors()[e].bit_location;
+        return p>0 && p+1<bs.raw_bits().size();
+    }
+
+    void reset( const bitstream &bs )
+    {
+        std::array<double,8> unknown;
+        unknown.fill( NAN );
+        cache_.assign( bs.error_count(), unknown );
+    }
+
+        //  Bits of the record from its frame start (after the SYN leader and the '*') to its end (after the EOT)
+    static size_t frame_bits( const std::vector<bool> &encoded )
+    {
+        return encoded.size()-LEADER_BITS;
+    }
+
+        //  Bits of the bitstream covered by the frame, with its leader
+    static void frame_span( const bitstream &bs, const kim_frame &frame, size_t &begin, size_t &end )
+    {
+        begin = frame.data>LEADER_BITS?frame.data-LEADER_BITS:0;
+        end = std::min( frame.slash+48, bs.raw_bits().size() );
+    }
+
+        //  The frames all start after the same '*', so a record only fits the one of its length
+    static int frame_of( const std::vector<kim_frame> &frames, const std::vector<bool> &encoded )
+    {
+        for (size_t f=0;f!=frames.size();f++)
+            if (frames[f].slash+48-frames[f].data==frame_bits( encoded ))
+                return f;
+        return -1;
+    }
+
+        //  The bits of the bitstream that the record would give, in [begin,end), or an empty vector if it fits no frame
+    static std::vector<bool> record_bits( const bitstream &bs, const std::vector<kim_frame> &frames, const kim_data &kd, int &frame, size_t &begin, size_t &end )
+    {
+        auto encoded = kim_encode_bits( kd );
+        frame = frame_of( frames, encoded );
+        if (frame<0)
+            return {};
+
+        auto result = bs.raw_bits();
+        ptrdiff_t offset = frames[frame].data-LEADER_BITS;
+        for (ptrdiff_t i=std::max( (ptrdiff_t)0, -offset );i!=(ptrdiff_t)encoded.size() && i+offset<(ptrdiff_t)result.size();i++)
+            result[i+offset] = encoded[i];
+        begin = std::max( offset, (ptrdiff_t)0 );
+        end = std::min( offset+encoded.size(), result.size() );
+        return result;
+    }
+
+public:
+    synthesis_verifier( const std::vector<sample_t> &samples, uint32_t rate )
+        : samples_{ samples }, rate_{ rate }, bit_( rate*BIT_DURATION+0.5 ), slack_( rate*BIT_DURATION/6+0.5 )
+    {
+        for (int value=0;value!=8;value++)
+        {
+            std::vector<uint8_t> bytes;
+            for (int i=0;i!=3;i++)
+                write_wav_bit( value&(1<<i), bytes, rate );
+            bytes.resize( bytes.size()&~15 );
+            waves_.emplace_back( bytes.size() );
+            for (size_t i=0;i!=bytes.size();i++)
+                waves_.back()[i] = bytes[i]-MID;
+        }
+    }
+
+    /// @brief Fixes the unknown bits whose value the audio makes clear, so the search has fewer combinations to try.
+    /// Only the bits of the possible records are looked at (not the noise between them), and a neighbour that is unknown too
+    /// can take either value
+    /// @return the bitstream with only the other unknown bits
+    bitstream settle( const bitstream &bs, bool report = true )
+    {
+        reset( bs );
+        auto &raw = bs.raw_bits();
+        auto error = bs.error_mask();
+        std::vector<bool> bits = raw;
+        std::vector<fix_t> left;
+
+        std::vector<bool> in_record( raw.size(), false );
+        for (auto frame:find_frames( raw, error ))
+        {
+            size_t begin, end;
+            frame_span( bs, frame, begin, end );
+            std::fill( in_record.begin()+begin, in_record.begin()+end, true );
+        }
+
+        for (size_t e=0;e!=bs.error_count();e++)
+        {
+            size_t p = bs.errors()[e].bit_location;
+            double best[2] = { 0, 0 };
+            if (in_record[p] && scorable( bs, e ))
+                for (int value=0;value!=8;value++)
+                {
+                    if (!error[p-1] && raw[p-1]!=(bool)(value&1))
+                        continue;
+                    if (!error[p+1] && raw[p+1]!=(bool)(value&4))
+                        continue;
+                    auto &b = best[(value>>1)&1];
+                    b = std::max( b, score( bs, e, value ) );
+                }
+            int winner = best[1]>best[0];
+            if (best[winner]>=SETTLE_MATCH && best[winner]-best[!winner]>=SETTLE_MARGIN)
+                bits[p] = winner;
+            else
+                left.push_back( bs.errors()[e] );
+        }
+
+        if (report && left.size()!=bs.error_count())
+            std::clog << "Synthesis settled " << bs.error_count()-left.size() << " of " << bs.error_count() << " unknown bits\n";
+        return bitstream{ bits, left };
+    }
+
+    /// @brief Returns the settled bitstream, with the unknown bits of the frames that gave none of the records as they
+    /// were in bs: a wrongly settled bit hides the record of its frame
+    bitstream unsettle( const bitstream &bs, const bitstream &settled, const std::vector<kim_data> &records ) const
+    {
+        auto frames = find_frames( bs.raw_bits(), bs.error_mask() );
+        std::vector<bool> matched( frames.size(), false );
+        for (auto &kd:records)
+        {
+            int f = frame_of( frames, kim_encode_bits( kd ) );
+            if (f>=0)
+                matched[f] = true;
+        }
+
+        std::vector<bool> restore( bs.raw_bits().size(), false );
+        for (size_t f=0;f!=frames.size();f++)
+            if (!matched[f])
+            {
+                size_t begin, end;
+                frame_span( bs, frames[f], begin, end );
+                std::fill( restore.begin()+begin, restore.begin()+end, true );
+            }
+
+        auto bits = settled.raw_bits();
+        auto unknown = settled.error_mask();
+        std::vector<fix_t> errors;
+        for (auto &e:bs.errors())
+            if (restore[e.bit_location] || unknown[e.bit_location])
+            {
+                bits[e.bit_location] = bs.raw_bits()[e.bit_location];
+                errors.push_back( e );
+            }
+        return bitstream{ bits, errors };
+    }
+
+    /// @brief Sorts the records found in the bitstream. The records of a frame are sorted by how well they match the audio
+    /// (mean score over the unknown bits of the frame), and the frames are kept in tape order. Records that fit no frame go last
+    void rank( const bitstream &bs, std::vector<kim_data> &records, bool report = true )
+    {
+        reset( bs );
+        auto frames = find_frames( bs.raw_bits(), bs.error_mask() );
+        struct ranked_t
+        {
+            int frame;
+            double score;
+            size_t record;
+        };
+        std::vector<ranked_t> scores;
+        for (size_t r=0;r!=records.size();r++)
+        {
+            int frame;
+            size_t begin, end;
+            auto bits = record_bits( bs, frames, records[r], frame, begin, end );
+            double total = 0;
+            size_t count = 0;
+            if (!bits.empty())
+                for (size_t e=0;e!=bs.error_count();e++)
+                    if (bs.errors()[e].bit_location>=begin && bs.errors()[e].bit_location<end && scorable( bs, e ))
+                    {
+                        size_t p = bs.errors()[e].bit_location;
+                        total += score( bs, e, bits[p-1] | bits[p]<<1 | bits[p+1]<<2 );
+                        count++;
+                    }
+            scores.push_back( { frame<0?INT32_MAX:frame, count?total/count:0, r } );
+        }
+        std::stable_sort( std::begin(scores), std::end(scores), []( const ranked_t &a, const ranked_t &b )
+            { return a.frame!=b.frame ? a.frame<b.frame : a.score>b.score; } );
+
+        std::vector<kim_data> sorted;
+        for (auto &s:scores)
+            sorted.push_back( records[s.record] );
+        records = std::move( sorted );
+
+        if (report)
+        {
+            std::clog << "Records ranked by synthesis (frames in tape order, mean score over their unknown bits):\n";
+            for (size_t i=0;i!=scores.size() && i!=8;i++)
+                diag.printf( "  #%zu ID=%02X ADRS=%04X CHKSUM=%04X frame %d score %.2f\n", i+1, records[i].id, records[i].adrs, records[i].checksum,
+                    scores[i].frame==INT32_MAX?0:scores[i].frame+1, scores[i].score );
+            if (scores.size()>8)
+                diag.printf( "  ... %zu more\n", scores.size()-8 );
+            diag.flush();
+        }
+    }
+};
+
+void test_synthesis()
+{
+    auto kd = test_record( { 0x12, 0x34, 0xAB, 0xCD, 0x5E } );
+
+        //  The tape of the record, with 3 unknown bits (2 of them adjacent), dated from their start
+    auto bits = kim_encode_bits( kd );
+    std::vector<uint8_t> samples;
+    for (auto b:bits)
+        write_wav_bit( b, samples );
+    double bit_duration = (double)samples.size()/bits.size()/RATE;
+    auto erase = [&]( std::initializer_list<size_t> positions )
+    {
+        std::vector<fix_t> errors;
+        auto unknown = bits;
+        for (size_t p:positions)
+        {
+            errors.push_back( { p, p*bit_duration } );
+            unknown[p] = !bits[p];
+        }
+        return bitstream{ unknown, errors };
+    };
+    synthesis_verifier verifier{ samples, (uint32_t)RATE };
+
+    auto settled = verifier.settle( erase( { 830, 831, 861 } ), false );
+    assert( settled.error_count()==0 );
+    assert( settled.raw_bits()==bits );
+
+        //  Another record that passes the checksum: 0x12 0x34 becomes 0x13 0x33, which only differ on the unknown bits
+    auto other = kd;
+    other.data[3] += 0x01;
+    other.data[4] -= 0x01;
+    std::vector<kim_data> records{ other, kd };
+    verifier.rank( erase( { 864, 880, 881, 882 } ), records, false );
+    assert( records[0]==kd );
+
+        //  Same, on a noisy tape whose timestamps are late by a sixth of a bit (a segment is a third)
+    uint32_t seed = 1;
+    for (auto &sample:samples)
+    {
+        seed = seed*1103515245+12345;
+        sample = std::min( std::max( sample+(int)((seed>>16)%81)-40, 0 ), 255 );
+    }
+    auto late = [&]( const bitstream &bs )
+    {
+        auto errors = bs.errors();
+        for (auto &e:errors)
+            e.source_ts += bit_duration/6;
+        return bitstream{ bs.raw_bits(), errors };
+    };
+    synthesis_verifier noisy{ samples, (uint32_t)RATE };
+    settled = noisy.settle( late( erase( { 830, 831, 861 } ) ), false );
+    assert( settled.error_count()==0 && settled.raw_bits()==bits );
+    records = { other, kd };
+    noisy.rank( late( erase( { 864, 880, 881, 882 } ) ), records, false );
+    assert( records[0]==kd );
+}
+
+bool dump_bytestream = false;
+int dump_bytestream_offset = 0;
+
+/// @brief Patches the bitstream as specified, and finds all the records that it can be
+/// @param found called for each new record
+/// @param verifier if not null, settles the unknown bits the audio is clear about before searching, and ranks the records found
+/// @param times timestamp of each bit in the source, for the bits realign() makes unknown
+template <class F>
+std::vector<kim_data> search( bitstream bs, const decode_options &options, F found, synthesis_verifier *verifier = nullptr, const std::vector<double> &times = {} )
+{
+    std::vector<kim_data> matches;
+
+        //  A lost or spurious bit shifts all the characters after it, we realign them before anything else
+    realign( bs, !quiet, times );
+
+        //  we patch according to user specs
+    bs.patch( options.patch );
+
+    auto add_match = [&]( const kim_data &kd )
+    {
+        if (std::find( std::begin(matches), std::end(matches), kd )==std::end(matches))
+        {
+            matches.push_back( kd );
+            found( kd );
+        }
+    };
+
+        //  Too many unknown bits to try them all, we solve for the checksum instead
+    auto run = [&]( const bitstream &bs )
+    {
+        if (options.search=="solve" || (options.search=="auto" && bs.error_count()>ENUMERATION_LIMIT) || bs.error_count()>=64)
+            solve_checksum( bs, add_match, !quiet, options.deadline );
+        else
+            enumerate_fixes( bs, options, add_match );
+    };
+
+    if (verifier)
+    {
+            //  A wrongly settled bit would hide the record of its frame, so the frames without a match are searched again
+            //  with their unknown bits as they were before settling
+        auto settled = verifier->settle( bs, !quiet );
+        run( settled );
+        auto retry = verifier->unsettle( bs, settled, matches );
+        if (retry.error_count()!=settled.error_count() && !interrupted)
+        {
+            if (!quiet)
+                std::clog << "Frames without a record with the settled bits, searching their unknown bits again\n";
+            run( retry );
+        }
+        if (matches.size()>1)
+            verifier->rank( bs, matches, !quiet );
+    }
+    else
+        run( bs );
+
+    return matches;
+}
+
+void parse( bitstream bs, const decode_options &options, synthesis_verifier *verifier = nullptr, const std::vector<double> &times = {} )
+{
+    // for (int i=0;i!=8;i++)
+    // {
+    //     std::cout << "\n\n\n------------------------------------- " << i << "\n\n\n";
+    //     std::cout << string_from_bits( p.result, i );
+    // }
+
+    // auto start = kim_data_from_bits( p.result );
+
+    // std::cout << bs.fix_count() << "\n";
 
     if (dump_bitstream)
         bs.dump_binary();
 
-//  If we dump the bitstream
-    if (dump_bytestream)
-        bs.dump_hexa( dump_bytestream_offset );
+//  If we dump the bitstream
+    if (dump_bytestream)
+        bs.dump_hexa( dump_bytestream_offset );
+
+    auto matches = search( bs, options, []( const kim_data &kd )
+    {
+        diag.print( "Found parsable data with correct checksum:\n" );
+        kd.dump();
+    }, verifier, times );
+
+    if (flag_write_data || flag_write_kim || flag_write_bits || flag_write_wav)
+    {
+        if (matches.size()==0)
+            std::cerr << "**** Not data recovered, cannot write data\n";
+        if (matches.size()>1)
+            std::cerr << (verifier?"**** Several data matches, writing the best match\n":"**** Several data matches, writing first match\n");
+        if (matches.size()>=1)
+        {
+            if (flag_write_data)
+                write_data( matches[0], *open_output( path_write_data ) );
+            if (flag_write_kim)
+                write_kim( matches[0], *open_output( path_write_kim ) );
+            if (flag_write_bits)
+                write_bits( matches[0], *open_output( path_write_bits ) );
+            if (flag_write_wav)
+                write_wav( matches[0], *open_output( path_write_wav ) );
+        }
+    }
+    else if (matches.size()==0)
+        std::cerr << "**** No record found\n";
+
+// exit(0);
+
+//     if (bs.errors()>0)
+//     {
+//         std::cout << "Location in bitstream for corrupted segments:\n";
+//         for (int i=0;i!=p.fixes.size();i++)
+//         {
+//             auto f = p.fixes[i];
+//             bool bit = patch[i%patch.size()]=='1';
+//             std::cout << "  " << from_time( f.timestamp ) << "-" << from_time( f.timestamp+7.452/1000 ) << " -- bit #" << f.bit_location << " inserted " << bit << "\n";
+//             p.result[p.fixes[i].bit_location] = bit;
+//         }
+    // }
+}
+
+
+
+/// @brief Streaming form of the normalize() thresholding: each sample becomes 255 if above the average of its neighbourhood, 0 otherwise.
+/// Keeps a running sum, so the cost per sample does not depend on the width. Output lags the input by width+1 samples
+class smoother
+{
+    size_t width_;
+    std::vector<sample_t> history_;     //  Last 2*width+1 samples, circular
+    size_t pos_ = 0;                    //  Where the next sample goes in history_
+    size_t count_ = 0;                  //  Number of samples received
+    int sum_ = 0;                       //  Sum of the 2*width samples before the next one
+
+public:
+    smoother( size_t width ) : width_{ width }, history_( 2*width+1 )
+    {
+    }
+
+    //  Appends to result the output produced by the samples [b,e)
+    void process( const sample_t *b, const sample_t *e, std::vector<sample_t> &result )
+    {
+        const size_t n = history_.size();
+        const int divisor = 2*width_+1;
+        for (;b!=e;b++)
+        {
+            if (count_++>=2*width_)
+            {
+                    //  Sample at the center of the 2*width previous ones
+                size_t center = pos_>=width_?pos_-width_:pos_+n-width_;
+                result.push_back( history_[center]>sum_/divisor?255:0 );
+                sum_ -= history_[pos_+1==n?0:pos_+1];
+            }
+            history_[pos_] = *b;
+            sum_ += *b;
+            pos_ = pos_+1==n?0:pos_+1;
+        }
+    }
+};
+
+/// @brief Compares each sample to the average of the 2*width around it. Output is width samples shorter on each side
+std::vector<sample_t> normalize( const std::vector<sample_t> &data, int width=0 )
+{
+    if (width==0)
+        return data;
+
+    std::vector<sample_t> result;
+    result.reserve( data.size() );
+    smoother{ (size_t)width }.process( data.data(), data.data()+data.size(), result );
+    return result;
+}
+
+
+
+
+
+
+
+/// @brief Causal signal conditioning: DC-blocking high-pass followed by an automatic gain control.
+/// Unlike normalize(), it only looks at past samples, costs a few integer operations per sample and can be fed block by block.
+class conditioner
+{
+    static const int64_t TARGET = 100;     //  Output amplitude around MID
+
+    int64_t dc_ = (int64_t)MID<<16;         //  Running average of the input (16.16 fixed point)
+    int64_t envelope_ = 0;                  //  Peak envelope of the centered signal (16.16 fixed point)
+    int dc_shift_;                          //  Time constant of the DC blocker, as a power of 2 of samples
+    int decay_shift_;                       //  Time constant of the envelope decay
+
+    static int shift_for( double samples )
+    {
+        int shift = 0;
+        while ((1<<(shift+1))<=samples)
+            shift++;
+        return shift;
+    }
+
+public:
+        //  DC tracks over ~10ms (far longer than a 2400Hz cycle), the envelope decays over ~20ms (a few bits)
+    conditioner( uint32_t rate )
+        : dc_shift_{ shift_for( rate*0.010 ) }, decay_shift_{ shift_for( rate*0.020 ) }
+    {
+    }
+
+    sample_t operator()( sample_t sample )
+    {
+        int64_t x = (int64_t)sample<<16;
+        dc_ += (x-dc_)>>dc_shift_;
+        int64_t y = x-dc_;
+
+        int64_t a = y<0?-y:y;
+        if (a>envelope_)
+            envelope_ = a;
+        else
+            envelope_ -= envelope_>>decay_shift_;
+
+            //  Floor avoids turning silence into full scale noise
+        int64_t v = MID+y*TARGET/std::max( envelope_, (int64_t)2<<16 );
+        return std::min( std::max( v, (int64_t)0 ), (int64_t)255 );
+    }
+
+    void process( sample_t *b, sample_t *e )
+    {
+        while (b!=e)
+        {
+            *b = (*this)( *b );
+            b++;
+        }
+    }
+};
+
+/// @brief Runs the conditioner over the whole buffer. Output has the same length as the input
+std::vector<sample_t> condition( std::vector<sample_t> data, uint32_t rate )
+{
+    conditioner c{ rate };
+    c.process( data.data(), data.data()+data.size() );
+    return data;
+}
+
+/// @brief A stretch of KIM-1 tones found by prescan(): a record, from its SYN leader to its EOT
+struct tone_region
+{
+    size_t start;           //  Samples
+    size_t end;
+    double leader;          //  Duration of the uninterrupted tone at the start, in seconds (the 100 SYN are 6s)
+    double damaged;         //  Fraction of the region that doesn't look like KIM-1 tones
+
+    bool clean() const { return leader>=4 && damaged<0.02; }
+};
+
+/// @brief Finds the records in a capture without demodulating it. The samples are cut in 10ms blocks, and a block is a
+/// KIM-1 tone if it has some energy and a crossing rate between the 2415Hz and 3623Hz mixes of a 0 or a 1 (2800-3200/s).
+/// Tone blocks less than 0.5s apart are joined, and only stretches of at least 2s (a third of the leader) are kept.
+/// Costs one SIMD pass: crossings are counted from the movemask of the sample signs, energy with a sum of absolute differences
+std::vector<tone_region> prescan( const std::vector<sample_t> &data, uint32_t rate )
+{
+    const size_t block = rate/100;
+    const size_t min_crossings = 25, max_crossings = 36;    //  Per 10ms, a bit of margin for speed and quantization
+    const size_t min_energy = 4*block;                      //  Average distance to MID of 4
+    const size_t max_gap = 50, min_blocks = 200;            //  In blocks
+
+    std::vector<bool> tone;
+    unsigned carry = 0;
+    for (size_t b=0;b+block<=data.size();b+=block)
+    {
+        const sample_t *p = data.data()+b;
+        const sample_t *e = p+block;
+        size_t crossings = 0, energy = 0;
+#ifdef __SSE2__
+        const __m128i mid = _mm_set1_epi8( (char)MID );
+        for (;e-p>=16;p+=16)
+        {
+            crossings += __builtin_popcount( rising_mask( p, carry ) );
+            __m128i sad = _mm_sad_epu8( _mm_loadu_si128( (const __m128i *)p ), mid );
+            energy += _mm_cvtsi128_si32( sad )+_mm_extract_epi16( sad, 4 );
+        }
+#endif
+        for (;p!=e;p++)
+        {
+            unsigned high = *p>=MID;
+            crossings += high & ~carry;
+            carry = high;
+            energy += std::abs( *p-(int)MID );
+        }
+        tone.push_back( energy>=min_energy && crossings>=min_crossings && crossings<=max_crossings );
+    }
+
+    std::vector<tone_region> result;
+    for (size_t i=0;i!=tone.size();)
+    {
+        if (!tone[i])
+        {
+            i++;
+            continue;
+        }
+
+        size_t first = i, last = i, count = 0, leader = 0;
+        bool steady = true;
+        for (size_t j=i;j!=tone.size() && j<=last+max_gap;j++)
+            if (tone[j])
+            {
+                steady = steady && j==last+(j!=first);
+                if (steady)
+                    leader++;
+                last = j;
+                count++;
+            }
+        i = last+1;
+
+        if (count<min_blocks)
+            continue;
+        size_t blocks = last+1-first;
+        result.push_back( { first*block, (last+1)*block, leader/100.0, (blocks-count)/(double)blocks } );
+    }
+    return result;
+}
+
+/// @brief A span of samples [start,end)
+struct region_t
+{
+    size_t start;
+    size_t end;
+};
+
+/// @brief Merges the damaged spots (erasures, '*' and '?') into sample regions, each extended by margin
+std::vector<region_t> damaged_regions( const demodulated &d, size_t margin )
+{
+    std::vector<size_t> spots = d.damage;
+    for (auto &f:d.fixes)
+        spots.push_back( d.positions[f.bit_location] );
+    std::sort( std::begin(spots), std::end(spots) );
+
+    std::vector<region_t> result;
+    for (auto s:spots)
+    {
+        size_t start = s>margin?s-margin:0;
+        if (result.size()>0 && start<=result.back().end)
+            result.back().end = s+margin;
+        else
+            result.push_back( { start, s+margin } );
+    }
+    return result;
+}
+
+/// @brief Re-demodulates only the damaged regions with more expensive settings, and splices the recovered bits back.
+/// Each region is delimited by the last good bit before it and the first good bit after it. The bits in between are
+/// replaced when an alternate decoding of the surrounding samples has fewer erasures and the expected number of bits.
+/// @param data the original samples (before any smoothing)
+/// @param d the result of the first pass, with positions relative to data
+/// @param options the settings of the first pass: alternatives use wider smoothing, and other pulse width tolerances
+demodulated repair( const std::vector<sample_t> &data, uint32_t rate, const demodulated &d, const decode_options &options )
+{
+    const double period = rate*BIT_DURATION;
+    const size_t context = rate/20;    //  50ms of samples around each window so the parser and filters settle
+
+        //  Alternatives, from cheapest to most expensive
+    std::vector<int> widths;
+    for (int w:{ 15, 30, 50 })
+        if (w>options.smooth)
+            widths.push_back( w );
+
+    auto is_error = std::vector<bool>( d.bits.size(), false );
+    for (auto &f:d.fixes)
+        is_error[f.bit_location] = true;
+
+    demodulated result;
+    size_t copied = 0;      //  Bits of d already copied into result
+    int repaired = 0;
+
+        //  Appends bits [from,to) of src to result
+    auto append = [&]( const demodulated &src, const std::vector<bool> &src_error, size_t from, size_t to )
+    {
+        for (size_t i=from;i<to;i++)
+        {
+            if (src_error[i])
+                result.fixes.push_back( { result.bits.size(), src.positions[i]/(double)rate } );
+            result.bits.push_back( src.bits[i] );
+            result.positions.push_back( src.positions[i] );
+        }
+    };
+
+    auto regions = damaged_regions( d, (size_t)(2*period) );
+    for (auto &r:regions)
+    {
+            //  Anchors: last good bit before the region, first good bit after
+        size_t i0 = std::lower_bound( std::begin(d.positions), std::end(d.positions), r.start )-std::begin(d.positions);
+        while (i0>copied && is_error[i0-1])
+            i0--;
+        if (i0<=copied)
+            continue;
+        i0--;
+        size_t i1 = std::upper_bound( std::begin(d.positions), std::end(d.positions), r.end )-std::begin(d.positions);
+        while (i1<d.bits.size() && is_error[i1])
+            i1++;
+        if (i1>=d.bits.size())
+            continue;
+
+        size_t s0 = d.positions[i0];
+        size_t s1 = d.positions[i1];
+        size_t expected = (size_t)((s1-s0)/period+0.5)-1;
+
+            //  Score of the original span: erasures, heavily penalized if the bit count is wrong
+        int original = std::count( std::begin(is_error)+i0+1, std::begin(is_error)+i1, true );
+        if (i1-i0-1!=expected)
+            original += 1000;
+        if (original==0)
+            continue;
+
+        size_t w0 = s0>context?s0-context:0;
+        size_t w1 = std::min( s1+context, data.size() );
+        std::vector<sample_t> window{ std::begin(data)+w0, std::begin(data)+w1 };
+
+        demodulated best;
+        size_t best_from = 0, best_to = 0;
+        int best_score = original;
+
+        auto attempt = [&]( demodulated alt )
+        {
+            std::vector<bool> alt_error( alt.bits.size(), false );
+            for (auto &f:alt.fixes)
+                alt_error[f.bit_location] = true;
+
+                //  The alternate decoding must have the two anchors, as good bits
+            auto near = [&]( size_t pos )
+            {
+                for (size_t i=0;i!=alt.bits.size();i++)
+                    if (!alt_error[i] && alt.positions[i]+period/2>pos && alt.positions[i]<pos+period/2)
+                        return i;
+                return alt.bits.size();
+            };
+            size_t a0 = near( s0 );
+            size_t a1 = near( s1 );
+            if (a0>=alt.bits.size() || a1>=alt.bits.size() || a1<=a0)
+                return;
+
+            int score = std::count( std::begin(alt_error)+a0+1, std::begin(alt_error)+a1, true );
+            if (a1-a0-1!=expected)
+                score += 1000;
+            if (score<best_score)
+            {
+                best_score = score;
+                best_from = a0+1;
+                best_to = a1;
+                best = std::move( alt );
+            }
+        };
+
+            //  Cheapest first: the crossings are extracted once, and parsed with narrower and wider pulse windows
+        auto crossings = extract_crossings( window, rate, w0, options.hysteresis );
+        for (double t:{ 0.75, 1.25 })
+            if (best_score>0)
+                attempt( demodulate( crossings, rate, options.tolerance*t ) );
+        auto alternative = [&]( const std::vector<sample_t> &samples, size_t start )
+        {
+            if (best_score>0)
+                attempt( demodulate( samples, rate, start, options.hysteresis, options.tolerance ) );
+        };
+        for (auto w:widths)
+            alternative( normalize( window, w ), w0+w );
+        alternative( condition( window, rate ), w0 );
+        for (auto w:widths)
+            alternative( normalize( condition( window, rate ), w ), w0+w );
+
+        if (best_score<original)
+        {
+            std::vector<bool> best_error( best.bits.size(), false );
+            for (auto &f:best.fixes)
+                best_error[f.bit_location] = true;
+            append( d, is_error, copied, i0+1 );
+            append( best, best_error, best_from, best_to );
+            copied = i1;
+            repaired++;
+        }
+    }
+    append( d, is_error, copied, d.bits.size() );
+
+        //  Damage events and statistics are those of the first pass
+    result.damage = d.damage;
+    result.stats = d.stats;
+
+    if (!quiet)
+        std::clog << "Repaired " << repaired << " damaged regions, " << d.fixes.size() << " -> " << result.fixes.size() << " unknown bits\n";
+
+    return result;
+}
+
+/// @brief Fuses several demodulations of the same tape (other takes, other channels).
+/// Takes are aligned on the '*' that ends the SYN leader. Bits that all the takes who know them agree on are kept,
+/// disagreeing bits (or bits nobody knows) become unknown bits.
+demodulated fuse( const std::vector<demodulated> &takes, uint32_t rate )
+{
+    struct aligned_t
+    {
+        const demodulated *d;
+        std::vector<bool> error;
+        size_t start;           //  Bit index of the first data bit
+    };
+
+    std::vector<aligned_t> aligned;
+    for (size_t i=0;i!=takes.size();i++)
+    {
+        auto &d = takes[i];
+        std::vector<bool> error( d.bits.size(), false );
+        for (auto &f:d.fixes)
+            error[f.bit_location] = true;
+        auto start = find_data_start( d.bits, error );
+        if (start==d.bits.size())
+        {
+            if (!quiet)
+                std::clog << "Take #" << i+1 << ": no SYN leader found, ignored\n";
+            continue;
+        }
+        aligned.push_back( { &d, error, start } );
+    }
+
+    if (aligned.size()==0)
+        return takes.size()>0?takes[0]:demodulated{};
+
+        //  Fused stream spans from the earliest leader to the longest tail
+    size_t before = 0, after = 0;
+    for (auto &a:aligned)
+    {
+        before = std::max( before, a.start );
+        after = std::max( after, a.d->bits.size()-a.start );
+    }
+
+    demodulated result;
+    for (size_t j=0;j!=before+after;j++)
+    {
+        int ones = 0, zeros = 0;
+        size_t position = 0;
+        bool covered = false;
+        for (auto &a:aligned)
+        {
+            if (j+a.start<before || j+a.start-before>=a.d->bits.size())
+                continue;
+            size_t i = j+a.start-before;
+            if (!covered)
+                position = a.d->positions[i];
+            covered = true;
+            if (!a.error[i])
+                (a.d->bits[i]?ones:zeros)++;
+        }
+        if (!covered)
+            continue;
+
+        if ((ones>0)==(zeros>0))
+        {
+            result.fixes.push_back( { result.bits.size(), position/(double)rate } );
+            result.bits.push_back( 1 );
+        }
+        else
+            result.bits.push_back( ones>0 );
+        result.positions.push_back( position );
+    }
+
+    for (auto &t:takes)
+        result.stats.merge( t.stats );
+
+    if (!quiet)
+        std::clog << "Fused " << aligned.size() << " takes: " << result.bits.size() << " bits, " << result.fixes.size() << " unknown bits\n";
+
+    return result;
+}
+
+/// @brief Exports the demodulation statistics, as JSON if the file name ends with .json, as CSV otherwise.
+/// The CSV has a kind,a,b,count line per non-empty bin: width,<samples>,, / group,<9 pulses>,<6 pulses> / star|question|hash,<second>,
+bool write_stats( const parser_stats &stats, const std::string &path )
+{
+    auto out = open_output( path );
+    bool json = path.size()>=5 && path.substr( path.size()-5 )==".json";
+    const char *events[3] = { "star", "question", "hash" };
+
+    if (!json)
+    {
+        out->print( "kind,a,b,count\n" );
+        for (size_t w=0;w!=stats.widths.size();w++)
+            if (stats.widths[w])
+                out->printf( "width,%zu,,%u\n", w, stats.widths[w] );
+        for (int i=0;i!=parser_stats::MAX_GROUP;i++)
+            for (int j=0;j!=parser_stats::MAX_GROUP;j++)
+                if (stats.groups[i][j])
+                    out->printf( "group,%d,%d,%u\n", i, j, stats.groups[i][j] );
+        for (size_t t=0;t!=stats.timeline.size();t++)
+            for (int k=0;k!=3;k++)
+                if (stats.timeline[t][k])
+                    out->printf( "%s,%zu,,%u\n", events[k], t, stats.timeline[t][k] );
+        return out->flush();
+    }
+
+        //  Most frequent width on each side of the 9/6 split: compared to the theory, it tells the tape speed
+    auto peak = [&]( size_t from, size_t to )
+    {
+        size_t best = from;
+        for (size_t w=from;w<to && w<stats.widths.size();w++)
+            if (stats.widths[w]>stats.widths[best])
+                best = w;
+        return best;
+    };
+    size_t split = stats.window_9[1]+1;
+    size_t peak_9 = peak( 1, split );
+    size_t peak_6 = peak( split, stats.widths.size()-1 );
+
+    out->printf( "{\n  \"rate\": %u,\n", stats.rate );
+    out->printf( "  \"width_9\": %.3f, \"window_9\": [%zu, %zu], \"peak_9\": %zu, \"speed_9\": %.3f,\n",
+        stats.width_9, stats.window_9[0], stats.window_9[1], peak_9, stats.width_9/std::max( peak_9, (size_t)1 ) );
+    out->printf( "  \"width_6\": %.3f, \"window_6\": [%zu, %zu], \"peak_6\": %zu, \"speed_6\": %.3f,\n",
+        stats.width_6, stats.window_6[0], stats.window_6[1], peak_6, stats.width_6/std::max( peak_6, (size_t)1 ) );
+
+    out->print( "  \"widths\": [" );
+    for (size_t w=0;w!=stats.widths.size();w++)
+        out->printf( "%s%u", w?", ":"", stats.widths[w] );
+    out->print( "],\n  \"groups\": [" );
+    const char *sep = "";
+    for (int i=0;i!=parser_stats::MAX_GROUP;i++)
+        for (int j=0;j!=parser_stats::MAX_GROUP;j++)
+            if (stats.groups[i][j])
+            {
+                out->printf( "%s{ \"c9\": %d, \"c6\": %d, \"count\": %u }", sep, i, j, stats.groups[i][j] );
+                sep = ", ";
+            }
+    out->print( "],\n  \"timeline\": [" );
+    for (size_t t=0;t!=stats.timeline.size();t++)
+        out->printf( "%s[%u, %u, %u]", t?", ":"", stats.timeline[t][0], stats.timeline[t][1], stats.timeline[t][2] );
+    out->print( "],\n  \"timeline_columns\": [\"star\", \"question\", \"hash\"]\n}\n" );
+
+    return out->flush();
+}
+
+bool bool_from_string( const std::string s )
+{
+    if (s=="true")
+        return true;
+    return false;
+}
+
+using namespace std;
+
+const int BUFF_SIZE = 1024;
+
+/// @brief Opens a WAV file and reads its header, leaving the stream at the first sample
+/// @param data_size receives the size in bytes of the samples
+/// @return false (after displaying an error) if the file cannot be read
+bool open_wav( ifstream &file, const char *file_name, uint32_t &sample_rate, uint16_t &num_channels, uint32_t &data_size )
+{
+  // Open the WAV file in binary mode
+  file.open(file_name, ios::binary);
+  if (!file.is_open())
+  {
+    cerr << "Could not open file " << file_name << endl;
+    return false;
+  }
+
+  // Read the WAV file header
+  char buffer[BUFF_SIZE];
+
+  // Read the chunk ID, should be "RIFF"
+  file.read(buffer, 4);
+  if (string(buffer, 4) != "RIFF")
+  {
+    cerr << "Invalid WAV file" << endl;
+    return false;
+  }
+
+  // Read the file size
+  uint32_t file_size;
+  file.read((char*)&file_size, sizeof(file_size));
+
+  // Read the file format, should be "WAVE"
+  file.read(buffer, 4);
+  if (string(buffer, 4) != "WAVE")
+  {
+    cerr << "Invalid WAV file" << endl;
+    return false;
+  }
+
+  // Read the format chunk ID, should be "fmt "
+  file.read(buffer, 4);
+  if (string(buffer, 4) != "fmt ")
+  {
+    cerr << "Invalid WAV file" << endl;
+    return false;
+  }
+
+  // Read the format chunk size
+  uint32_t format_chunk_size;
+  file.read((char*)&format_chunk_size, sizeof(format_chunk_size));
+
+  // Read the audio format
+  uint16_t audio_format;
+  file.read((char*)&audio_format, sizeof(audio_format));
+
+  // Read the number of channels
+  file.read((char*)&num_channels, sizeof(num_channels));
+
+  // Read the sample rate
+  file.read((char*)&sample_rate, sizeof(sample_rate));
+
+  // Read the byte rate
+  uint32_t byte_rate;
+  file.read((char*)&byte_rate, sizeof(byte_rate));
+
+  // Read the block align
+  uint16_t block_align;
+  file.read((char*)&block_align, sizeof(block_align));
+
+  // Read the bits per sample
+  uint16_t bits_per_sample;
+  file.read((char*)&bits_per_sample, sizeof(bits_per_sample));
+
+  // Print the file size, audio format, and number of channels
+//   cout << "File size: " << file_size << " bytes" << endl;
+//   cout << "Audio format: " << audio_format << " bytes" << endl;
+//   cout << "#channels: " << num_channels << " bytes" << endl;
+//   cout << "Sample rate: " << sample_rate << " bytes" << endl;
+//   cout << "Byte size: " << byte_rate << " bytes" << endl;
+//   cout << "Bits per sample: " << bits_per_sample << " bytes" << endl;
+
+  file.read(buffer, 4);
+  if (string(buffer, 4) != "data")
+  {
+    cerr << "Invalid WAV file" << endl;
+    return false;
+  }
+
+  if (!supported_rate( sample_rate ))
+  {
+    cerr << "Unsupported sample rate " << sample_rate << " (must be 22050, 44100, 48000 or 96000)" << endl;
+    return false;
+  }
+
+  if (bits_per_sample!=8 || num_channels==0)
+  {
+    cerr << "Only unsigned 8 bits WAV files are supported" << endl;
+    return false;
+  }
+
+  file.read((char*)&data_size, sizeof(data_size));
+
+  return true;
+}
+
+/// @brief Reads an unsigned 8 bits WAV file
+/// @param channels receives the samples of each channel
+/// @return false (after displaying an error) if the file cannot be read
+bool read_wav( const char *file_name, uint32_t &sample_rate, std::vector<std::vector<sample_t>> &channels )
+{
+    ifstream file;
+    uint16_t num_channels;
+    uint32_t sample_count;
+    if (!open_wav( file, file_name, sample_rate, num_channels, sample_count ))
+        return false;
+
+    std::vector<sample_t> raw_data( sample_count );
+    file.read( (char *)raw_data.data(), sample_count );
+    raw_data.resize( file.gcount() );
+
+        //  Samples are interleaved
+    channels.resize( num_channels );
+    for (size_t c=0;c!=num_channels;c++)
+        for (size_t i=c;i<raw_data.size();i+=num_channels)
+            channels[c].push_back( raw_data[i] );
+
+    return true;
+}
+
+/// @brief Streams a FLAC file frame by frame, as unsigned 8 bits samples (dependency-free decoder).
+/// Supports the CONSTANT, VERBATIM, FIXED and LPC subframes, Rice residuals and the stereo decorrelation modes,
+/// and checks the CRC of every frame
+class flac_reader
+{
+    ifstream file_;
+    std::vector<uint8_t> buffer_;
+    size_t next_ = 0;               //  Next byte of buffer_
+    bool eof_ = false;
+    uint64_t bits_ = 0;             //  Bits read ahead: only the low count_ ones are left to read
+    int count_ = 0;
+    uint8_t crc8_ = 0;              //  CRCs of the bytes read since the start of the frame
+    uint16_t crc16_ = 0;
+    uint32_t bits_per_sample_ = 0;
+    bool failed_ = false;
+    uint64_t decoded_ = 0;          //  Samples per channel so far
+    std::vector<std::vector<int64_t>> subframes_;
+
+    uint8_t next_byte()
+    {
+        if (next_==buffer_.size())
+        {
+            buffer_.resize( 64*1024 );
+            file_.read( (char *)buffer_.data(), buffer_.size() );
+            buffer_.resize( file_.gcount() );
+            next_ = 0;
+            if (buffer_.empty())
+            {
+                eof_ = true;
+                return 0;
+            }
+        }
+        uint8_t b = buffer_[next_++];
+        crc8_ = crc8_table()[crc8_^b];
+        crc16_ = crc16_<<8 ^ crc16_table()[(crc16_>>8)^b];
+        return b;
+    }
+
+        //  Reads n bits (up to 56), most significant first
+    uint64_t read( int n )
+    {
+        while (count_<n)
+        {
+            bits_ = bits_<<8 | next_byte();
+            count_ += 8;
+        }
+        count_ -= n;
+        return (bits_>>count_) & ((1ull<<n)-1);
+    }
+
+    int64_t read_signed( int n )
+    {
+        if (n==0)
+            return 0;
+        return (int64_t)(read( n )<<(64-n))>>(64-n);
+    }
+
+        //  Counts the 0 bits before the next 1
+    uint32_t read_unary()
+    {
+        uint32_t zeros = 0;
+        while (!eof_)
+        {
+            uint64_t left = bits_ & ((1ull<<count_)-1);
+            if (left)
+            {
+                int top = 63-__builtin_clzll( left );
+                zeros += count_-1-top;
+                count_ = top;
+                return zeros;
+            }
+            zeros += count_;
+            bits_ = next_byte();
+            count_ = 8;
+        }
+        return zeros;
+    }
+
+    bool fail( const char *message )
+    {
+        if (!failed_)
+            cerr << "Invalid FLAC file: " << message << endl;
+        failed_ = true;
+        return false;
+    }
+
+        //  Adds the Rice coded residual of the n-order samples of a subframe to out
+    bool read_residual( size_t order, std::vector<int64_t> &out )
+    {
+        size_t block_size = out.size();
+        auto method = read( 2 );
+        if (method>1)
+            return fail( "reserved residual coding method" );
+        int param_bits = method?5:4;
+        uint32_t escape = method?31:15;
+        auto partition_order = read( 4 );
+        size_t partition_size = block_size>>partition_order;
+        if (partition_size<<partition_order!=block_size || partition_size<order)
+            return fail( "bad residual partition" );
+
+        size_t i = order;
+        for (size_t p=0;p!=(1u<<partition_order);p++)
+        {
+            size_t end = (p+1)*partition_size;
+            uint32_t k = read( param_bits );
+            if (k==escape)
+            {
+                int n = read( 5 );
+                for (;i!=end;i++)
+                    out[i] = read_signed( n );
+            }
+            else
+                for (;i!=end;i++)
+                {
+                    uint64_t u = (uint64_t)read_unary()<<k | read( k );
+                    out[i] = (int64_t)(u>>1) ^ -(int64_t)(u&1);
+                }
+        }
+        return !eof_ || fail( "truncated residual" );
+    }
+
+    bool read_subframe( int bps, std::vector<int64_t> &out )
+    {
+        if (read( 1 ))
+            return fail( "bad subframe padding" );
+        auto type = read( 6 );
+        int wasted = 0;
+        if (read( 1 ))
+            wasted = read_unary()+1;
+        bps -= wasted;
+        if (bps<=0)
+            return fail( "bad wasted bits" );
+
+        size_t n = out.size();
+        if (type==0)
+            std::fill( out.begin(), out.end(), read_signed( bps ) );
+        else if (type==1)
+            for (auto &s:out)
+                s = read_signed( bps );
+        else if (type>=8 && type<=12)
+        {
+            size_t order = type-8;
+            if (order>n)
+                return fail( "predictor order larger than the block" );
+            for (size_t i=0;i!=order;i++)
+                out[i] = read_signed( bps );
+            if (!read_residual( order, out ))
+                return false;
+            int64_t *s = out.data();
+            switch (order)
+            {
+                case 1: for (size_t i=1;i<n;i++) s[i] += s[i-1]; break;
+                case 2: for (size_t i=2;i<n;i++) s[i] += 2*s[i-1]-s[i-2]; break;
+                case 3: for (size_t i=3;i<n;i++) s[i] += 3*s[i-1]-3*s[i-2]+s[i-3]; break;
+                case 4: for (size_t i=4;i<n;i++) s[i] += 4*s[i-1]-6*s[i-2]+4*s[i-3]-s[i-4]; break;
+            }
+        }
+        else if (type>=32)
+        {
+            size_t order = (type&31)+1;
+            if (order>n)
+                return fail( "predictor order larger than the block" );
+            for (size_t i=0;i!=order;i++)
+                out[i] = read_signed( bps );
+            int precision = read( 4 )+1;
+            if (precision==16)
+                return fail( "bad LPC precision" );
+            int shift = read_signed( 5 );
+            if (shift<0)
+                return fail( "negative LPC shift" );
+            int64_t coefs[32];
+            for (size_t j=0;j!=order;j++)
+                coefs[j] = read_signed( precision );
+            if (!read_residual( order, out ))
+                return false;
+            int64_t *s = out.data();
+            for (size_t i=order;i<n;i++)
+            {
+                int64_t sum = 0;
+                for (size_t j=0;j!=order;j++)
+                    sum += coefs[j]*s[i-1-j];
+                s[i] += sum>>shift;
+            }
+        }
+        else
+            return fail( "reserved subframe type" );
+
+        if (wasted)
+            for (auto &s:out)
+                s *= (int64_t)1<<wasted;
+        return true;
+    }
+
+        //  Reads the signature and the metadata, leaving the stream at the first frame
+    bool read_metadata()
+    {
+        if (read( 32 )!=0x664C6143)     //  "fLaC"
+            return fail( "no fLaC signature" );
+
+        bool last = false;
+        bool streaminfo = false;
+        while (!last && !eof_)
+        {
+            last = read( 1 );
+            auto type = read( 7 );
+            auto length = read( 24 );
+            if (type==0 && length>=34)
+            {
+                read( 16+16 );          //  Block and frame sizes
+                read( 24+24 );
+                sample_rate = read( 20 );
+                num_channels = read( 3 )+1;
+                bits_per_sample_ = read( 5 )+1;
+                total_samples = read( 36 );
+                length -= 18;
+                streaminfo = true;
+            }
+            while (length--)
+                read( 8 );
+        }
+        if (!streaminfo)
+            return fail( "no STREAMINFO" );
+
+        if (!supported_rate( sample_rate ))
+        {
+            cerr << "Unsupported sample rate " << sample_rate << " (must be 22050, 44100, 48000 or 96000)" << endl;
+            return false;
+        }
+        if (bits_per_sample_<4)
+            return fail( "bad sample size" );
+        subframes_.resize( num_channels );
+        return true;
+    }
+
+public:
+    uint32_t sample_rate = 0;
+    uint16_t num_channels = 0;
+    uint64_t total_samples = 0;     //  Per channel, 0 if unknown
+
+        //  CRC-8 (polynomial 0x07) of the frame headers and CRC-16 (0x8005) of the frames, a byte at a time
+    static const std::array<uint8_t,256> &crc8_table()
+    {
+        static const auto table = []
+        {
+            std::array<uint8_t,256> t;
+            for (int b=0;b!=256;b++)
+            {
+                uint8_t c = b;
+                for (int i=0;i!=8;i++)
+                    c = (c&0x80)?(c<<1)^0x07:c<<1;
+                t[b] = c;
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    static const std::array<uint16_t,256> &crc16_table()
+    {
+        static const auto table = []
+        {
+            std::array<uint16_t,256> t;
+            for (int b=0;b!=256;b++)
+            {
+                uint16_t c = b<<8;
+                for (int i=0;i!=8;i++)
+                    c = (c&0x8000)?(c<<1)^0x8005:c<<1;
+                t[b] = c;
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    bool failed() const { return failed_; }
+
+    /// @brief Reads the signature and the metadata, leaving the stream at the first frame
+    /// @return false (after displaying an error) if the file cannot be read
+    bool open( const char *file_name )
+    {
+        file_.open( file_name, ios::binary );
+        if (!file_.is_open())
+        {
+            cerr << "Could not open file " << file_name << endl;
+            return false;
+        }
+        return read_metadata();
+    }
+
+    /// @brief Same, on a FLAC stream in memory
+    bool open( std::vector<uint8_t> bytes )
+    {
+        buffer_ = std::move( bytes );
+        next_ = 0;
+        return read_metadata();
+    }
+
+    /// @brief Decodes the next frame, appending its samples to each channel
+    /// @return false at the end of the stream, or on error (see failed())
+    bool read_frame( std::vector<std::vector<sample_t>> &channels )
+    {
+        if (failed_ || eof_ || (total_samples && decoded_>=total_samples))
+            return false;
+
+        count_ = 0;         //  Frames start on a byte
+        crc8_ = 0;
+        crc16_ = 0;
+        auto sync = read( 14 );
+        if (eof_)
+            return false;
+        if (sync!=0x3FFE)
+            return fail( "lost frame sync" );
+        read( 2 );          //  Reserved and blocking strategy
+        auto block_code = read( 4 );
+        auto rate_code = read( 4 );
+        auto assignment = read( 4 );
+        auto size_code = read( 3 );
+        read( 1 );
+
+            //  Frame or sample number, UTF-8 style
+        auto first = read( 8 );
+        for (int mask=0x80;(first&mask) && mask>1;mask>>=1)
+            if (mask!=0x80)
+                read( 8 );
+
+        size_t block_size;
+        if (block_code==0)
+            return fail( "reserved block size" );
+        else if (block_code==1)
+            block_size = 192;
+        else if (block_code<=5)
+            block_size = 576<<(block_code-2);
+        else if (block_code==6)
+            block_size = read( 8 )+1;
+        else if (block_code==7)
+            block_size = read( 16 )+1;
+        else
+            block_size = 256<<(block_code-8);
+
+            //  The rate is the one from STREAMINFO, but its bytes must be skipped
+        if (rate_code==12)
+            read( 8 );
+        else if (rate_code==13 || rate_code==14)
+            read( 16 );
+        else if (rate_code==15)
+            return fail( "bad sample rate" );
+
+        static const int sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+        int bps = size_code?sizes[size_code]:bits_per_sample_;
+        if (bps==0)
+            return fail( "reserved sample size" );
+
+        uint8_t crc8 = crc8_;
+        if (read( 8 )!=crc8)
+            return fail( "frame header CRC mismatch" );
+
+        size_t frame_channels = assignment<8?assignment+1:2;
+        if (assignment>10 || frame_channels!=num_channels)
+            return fail( "bad channel assignment" );
+
+        for (size_t c=0;c!=num_channels;c++)
+        {
+                //  The side channel has one more bit
+            bool side = (assignment==8 && c==1) || (assignment==9 && c==0) || (assignment==10 && c==1);
+            subframes_[c].resize( block_size );
+            if (!read_subframe( bps+side, subframes_[c] ))
+                return false;
+        }
+
+        count_ = 0;
+        uint16_t crc16 = crc16_;
+        if (read( 16 )!=crc16)
+            return fail( "frame CRC mismatch" );
+
+        if (assignment>=8)
+        {
+            auto &a = subframes_[0];
+            auto &b = subframes_[1];
+            for (size_t i=0;i!=block_size;i++)
+                switch (assignment)
+                {
+                    case 8: b[i] = a[i]-b[i]; break;                //  left, side
+                    case 9: a[i] += b[i]; break;                    //  side, right
+                    case 10:                                        //  mid, side
+                    {
+                        int64_t mid = a[i]*2 | (b[i]&1);
+                        a[i] = (mid+b[i])>>1;
+                        b[i] = (mid-b[i])>>1;
+                        break;
+                    }
+                }
+        }
+
+        channels.resize( num_channels );
+        for (size_t c=0;c!=num_channels;c++)
+            for (auto s:subframes_[c])
+                channels[c].push_back( (sample_t)(MID+(bps>=8?s>>(bps-8):s*(1<<(8-bps)))) );
+        decoded_ += block_size;
+
+        return true;
+    }
+};
+
+/// @brief Reads a FLAC file, converted to unsigned 8 bits
+/// @param channels receives the samples of each channel
+/// @return false (after displaying an error) if the file cannot be read
+bool read_flac( const char *file_name, uint32_t &sample_rate, std::vector<std::vector<sample_t>> &channels )
+{
+    flac_reader flac;
+    if (!flac.open( file_name ))
+        return false;
+    sample_rate = flac.sample_rate;
+    channels.resize( flac.num_channels );
+    for (auto &c:channels)
+        c.reserve( flac.total_samples );
+    while (flac.read_frame( channels ))
+        ;
+    return !flac.failed();
+}
+
+/// @brief True if the file starts with the FLAC signature
+bool is_flac( const char *file_name )
+{
+    char magic[4] = {};
+    ifstream file( file_name, ios::binary );
+    file.read( magic, 4 );
+    return !memcmp( magic, "fLaC", 4 );
+}
+
+//  Tests for the FLAC decoder, on a mono 8 bits stream built in memory: a FIXED frame, an LPC frame whose residual has
+//  an escaped (raw) partition and a Rice one, then a frame with a wrong CRC
+void test_flac()
+{
+    struct bit_writer
+    {
+        std::vector<uint8_t> bytes;
+        int used = 0;           //  Bits used in the last byte
+
+        void put( uint64_t value, int n )
+        {
+            for (int i=n-1;i>=0;i--)
+            {
+                if (used==0)
+                    bytes.push_back( 0 );
+                bytes.back() |= ((value>>i)&1)<<(7-used);
+                used = (used+1)&7;
+            }
+        }
+
+        void put_rice( int64_t v, int k )
+        {
+            uint64_t u = v<0 ? ((uint64_t)-v<<1)-1 : (uint64_t)v<<1;
+            for (uint64_t q=u>>k;q;q--)
+                put( 0, 1 );
+            put( 1, 1 );
+            put( u, k );
+        }
+    };
+
+    const size_t N = 16;
+    std::vector<int64_t> s( 3*N );
+    for (size_t i=0;i!=s.size();i++)
+        s[i] = (int64_t)::round( 60*::sin( i*0.5 ) );
+
+    bit_writer w;
+    w.put( 0x664C6143, 32 );
+    w.put( 1, 1 );                  //  Last metadata block: STREAMINFO
+    w.put( 0, 7 );
+    w.put( 34, 24 );
+    w.put( N, 16 );
+    w.put( N, 16 );
+    w.put( 0, 24 );
+    w.put( 0, 24 );
+    w.put( 44100, 20 );
+    w.put( 0, 3 );                  //  1 channel
+    w.put( 7, 5 );                  //  8 bits
+    w.put( s.size(), 36 );
+    for (int i=0;i!=4;i++)          //  MD5
+        w.put( 0, 32 );
+
+    auto frame = [&]( unsigned number, auto subframe, bool corrupt )
+    {
+        size_t start = w.bytes.size();
+        w.put( 0x3FFE, 14 );
+        w.put( 0, 2 );
+        w.put( 6, 4 );              //  8 bits block size at the end of the header
+        w.put( 0, 4 );              //  Rate, channels and sample size of STREAMINFO
+        w.put( 0, 4 );
+        w.put( 0, 3 );
+        w.put( 0, 1 );
+        w.put( number, 8 );
+        w.put( N-1, 8 );
+        uint8_t crc8 = 0;
+        for (size_t i=start;i!=w.bytes.size();i++)
+            crc8 = flac_reader::crc8_table()[crc8^w.bytes[i]];
+        w.put( crc8, 8 );
+
+        w.put( 0, 1 );
+        subframe( &s[number*N] );
+        w.used = 0;
+        uint16_t crc16 = 0;
+        for (size_t i=start;i!=w.bytes.size();i++)
+            crc16 = crc16<<8 ^ flac_reader::crc16_table()[(crc16>>8)^w.bytes[i]];
+        w.put( crc16^corrupt, 16 );
+    };
+
+        //  FIXED, order 2, one Rice partition
+    frame( 0, [&]( const int64_t *x )
+    {
+        w.put( 8+2, 6 );
+        w.put( 0, 1 );
+        w.put( x[0]&0xff, 8 );
+        w.put( x[1]&0xff, 8 );
+        w.put( 0, 2 );
+        w.put( 0, 4 );
+        w.put( 3, 4 );
+        for (size_t i=2;i!=N;i++)
+            w.put_rice( x[i]-(2*x[i-1]-x[i-2]), 3 );
+    }, false );
+
+        //  LPC, order 2, prediction (3*x[i-1]-x[i-2])>>1, two partitions: the first escaped with 8 bits samples
+    frame( 1, [&]( const int64_t *x )
+    {
+        w.put( 32+1, 6 );
+        w.put( 0, 1 );
+        w.put( x[0]&0xff, 8 );
+        w.put( x[1]&0xff, 8 );
+        w.put( 4-1, 4 );            //  Precision
+        w.put( 1, 5 );              //  Shift
+        w.put( 3, 4 );
+        w.put( -1&0xf, 4 );
+        w.put( 0, 2 );
+        w.put( 1, 4 );
+        for (size_t i=2;i!=N;i++)
+        {
+            if (i==2)
+            {
+                w.put( 15, 4 );
+                w.put( 8, 5 );
+            }
+            if (i==N/2)
+                w.put( 4, 4 );
+            int64_t residual = x[i]-((3*x[i-1]-x[i-2])>>1);
+            if (i<N/2)
+                w.put( residual&0xff, 8 );
+            else
+                w.put_rice( residual, 4 );
+        }
+    }, false );
+
+        //  VERBATIM, with a wrong CRC
+    frame( 2, [&]( const int64_t *x )
+    {
+        w.put( 1, 6 );
+        w.put( 0, 1 );
+        for (size_t i=0;i!=N;i++)
+            w.put( x[i]&0xff, 8 );
+    }, true );
+
+    flac_reader flac;
+    assert( flac.open( w.bytes ) && flac.sample_rate==44100 && flac.num_channels==1 );
+    std::vector<std::vector<sample_t>> channels;
+    assert( flac.read_frame( channels ) && flac.read_frame( channels ) );
+    assert( channels[0].size()==2*N );
+    for (size_t i=0;i!=2*N;i++)
+        assert( channels[0][i]==MID+s[i] );
+
+    std::ostringstream errors;
+    auto cerr_buffer = cerr.rdbuf( errors.rdbuf() );
+    bool read = flac.read_frame( channels );
+    cerr.rdbuf( cerr_buffer );
+    assert( !read && flac.failed() && errors.str().find( "frame CRC mismatch" )!=std::string::npos );
+    assert( channels[0].size()==2*N );
+}
+
+/// @brief Reads an unsigned 8 bits WAV file or a FLAC file
+bool read_audio( const char *file_name, uint32_t &sample_rate, std::vector<std::vector<sample_t>> &channels )
+{
+    if (is_flac( file_name ))
+        return read_flac( file_name, sample_rate, channels );
+    return read_wav( file_name, sample_rate, channels );
+}
+
+    //  Shortest chunk worth its own thread, and how far before and after its chunk each thread parses (in seconds)
+const double CHUNK_MIN_DURATION = 60;
+const double CHUNK_OVERLAP = 1;
+
+/// @brief Finds the first bit that both decodings of the same samples agree on: same position, same value, and valid in both.
+/// After a valid bit the parser state is only made of that bit's time, so from there b continues exactly as a would have
+/// @param after only bits past this sample are considered
+/// @return false if there is no such bit (silence or damage over the whole overlap)
+bool find_sync( const demodulated &a, const demodulated &b, size_t after, size_t &ia, size_t &ib )
+{
+    std::vector<bool> a_error( a.bits.size(), false ), b_error( b.bits.size(), false );
+    for (auto &f:a.fixes)
+        a_error[f.bit_location] = true;
+    for (auto &f:b.fixes)
+        b_error[f.bit_location] = true;
+
+    for (ib=0;ib!=b.bits.size();ib++)
+    {
+        if (b_error[ib] || b.positions[ib]<=after)
+            continue;
+        ia = std::lower_bound( std::begin(a.positions), std::end(a.positions), b.positions[ib] )-std::begin(a.positions);
+        if (ia==a.bits.size())
+            return false;
+        if (a.positions[ia]==b.positions[ib] && !a_error[ia] && a.bits[ia]==b.bits[ib])
+            return true;
+    }
+    return false;
+}
+
+/// @brief Same result as demodulate(), but a long capture is cut into chunks demodulated on their own threads.
+/// Each thread starts parsing CHUNK_OVERLAP before its chunk and goes on CHUNK_OVERLAP after it. Two neighbours are joined
+/// at the first bit they agree on (see find_sync). Without one, the two spans are parsed again as one, so that the bits,
+/// fixes and their timestamps are always those of the sequential parse. Only the histograms count the overlaps twice.
+/// Adaptive hysteresis depends on the whole past of the signal, so it is always parsed in one go (as are parser traces)
+/// @param min_duration shortest chunk, in seconds
+demodulated demodulate_chunked( const std::vector<sample_t> &data, uint32_t rate, size_t start, const decode_options &options, double min_duration = CHUNK_MIN_DURATION )
+{
+    size_t overlap = rate*CHUNK_OVERLAP;
+    size_t count = std::min( options.threads, (size_t)(data.size()/(rate*min_duration)) );
+    if (count<=1 || options.hysteresis==HYSTERESIS_AUTO || tracing())
+    {
+        auto result = demodulate( data, rate, start, options.hysteresis, options.tolerance );
+        diag.flush();
+        return result;
+    }
+
+    auto parse = [&]( size_t from, size_t to )
+    {
+        crossings_t crossings{ start+from, {} };
+        crossing_detector{ rate, start+from, options.hysteresis }.process( data.data()+from, data.data()+to, crossings.intervals );
+        return demodulate( crossings, rate, options.tolerance );
+    };
+
+        //  Span parsed for each chunk
+    std::vector<size_t> from( count ), to( count );
+    for (size_t i=0;i!=count;i++)
+    {
+        size_t b = data.size()*i/count;
+        size_t e = data.size()*(i+1)/count;
+        from[i] = i?b-overlap:0;
+        to[i] = std::min( e+overlap, data.size() );
+    }
+
+    std::vector<demodulated> chunks( count );
+    std::vector<std::thread> threads;
+    for (size_t i=0;i!=count;i++)
+        threads.emplace_back( [&,i]{ chunks[i] = parse( from[i], to[i] ); } );
+    for (auto &t:threads)
+        t.join();
+
+    demodulated result;
+    demodulated current = std::move( chunks[0] );
+    size_t current_from = 0;        //  Span parsed for current starts at from[current_from]
+    size_t copied = 0;              //  Bits of current already in result
+    size_t damage_from = 0;         //  Damage before this sample is already in result
+
+        //  Appends bits [b,e) of d to result, with the damage up to sample 'until'
+    auto append = [&]( const demodulated &d, size_t b, size_t e, size_t until )
+    {
+        size_t base = result.bits.size();
+        result.bits.insert( result.bits.end(), d.bits.begin()+b, d.bits.begin()+e );
+        result.positions.insert( result.positions.end(), d.positions.begin()+b, d.positions.begin()+e );
+        for (auto &f:d.fixes)
+            if (f.bit_location>=b && f.bit_location<e)
+                result.fixes.push_back( { f.bit_location-b+base, f.source_ts } );
+        for (auto s:d.damage)
+            if (s>=damage_from && s<until)
+                result.damage.push_back( s );
+        damage_from = until;
+    };
+
+    for (size_t i=1;i!=count;i++)
+    {
+        size_t ia, ib;
+        size_t after = copied?current.positions[copied-1]:0;
+        if (find_sync( current, chunks[i], after, ia, ib ))
+        {
+            append( current, copied, ia+1, current.positions[ia]+1 );
+            result.stats.merge( current.stats );
+            current = std::move( chunks[i] );
+            current_from = i;
+            copied = ib+1;
+        }
+        else
+        {
+                //  Same start, so the bits already copied are unchanged
+            if (!quiet)
+                std::clog << "No common bit between chunks " << i << " and " << i+1 << ", parsing them again as one\n";
+            current = parse( from[current_from], to[i] );
+        }
+    }
+    append( current, copied, current.bits.size(), SIZE_MAX );
+    result.stats.merge( current.stats );
+
+    return result;
+}
+
+//  Tests that chunks give the bits, fixes, positions and damage of the sequential parse, when neighbours are joined
+//  on a common bit (noise bursts in the overlaps) and when they are not (a silence longer than the overlaps)
+void test_chunked()
+{
+    const uint32_t rate = 22050;
+    std::vector<sample_t> samples;
+    uint32_t seed = 1;
+    auto add_bits = [&]( size_t count )
+    {
+        for (size_t i=0;i!=count;i++)
+        {
+            seed = seed*1103515245+12345;
+            write_wav_bit( seed>>31, samples, rate );
+        }
+    };
+    auto add_noise = [&]( size_t count )
+    {
+        for (size_t i=0;i!=count;i++)
+        {
+            seed = seed*1103515245+12345;
+            samples.push_back( seed>>24 );
+        }
+    };
+    add_bits( 280 );
+    add_noise( rate/20 );
+    add_bits( 280 );
+    samples.insert( samples.end(), 3*rate, MID );
+    add_bits( 280 );
+    add_noise( rate/50 );
+    add_bits( 280 );
+
+    decode_options options;
+    options.threads = 4;
+    bool was_quiet = quiet;
+    quiet = true;
+    auto chunked = demodulate_chunked( samples, rate, 0, options, 2 );
+    quiet = was_quiet;
+    auto sequential = demodulate( samples, rate, 0, 0, 1 );
+
+    assert( chunked.bits==sequential.bits && chunked.positions==sequential.positions && chunked.damage==sequential.damage );
+    assert( chunked.fixes.size()==sequential.fixes.size() && chunked.fixes.size()>0 );
+    for (size_t i=0;i!=chunked.fixes.size();i++)
+        assert( chunked.fixes[i].bit_location==sequential.fixes[i].bit_location && chunked.fixes[i].source_ts==sequential.fixes[i].source_ts );
+}
+
+/// @brief Runs the whole sample processing (conditioning, smoothing, demodulation, repair) on one take
+demodulated decode_take( std::vector<sample_t> data, uint32_t rate, const decode_options &options )
+{
+    if (options.agc)
+        data = condition( data, rate );
+
+    demodulated demod;
+    if (options.prescan)
+    {
+            //  Each record with some margin, so the parser is settled when the leader starts
+        size_t margin = rate/5;
+        auto regions = prescan( data, rate );
+        if (!quiet)
+            std::clog << "Prescan: " << regions.size() << " records\n";
+        for (auto &r:regions)
+        {
+            size_t start = r.start>margin?r.start-margin:0;
+            size_t end = std::min( r.end+margin, data.size() );
+            auto norm = normalize( { data.begin()+start, data.begin()+end }, options.smooth );
+            demod.append( demodulate_chunked( norm, rate, start+options.smooth, options ) );
+        }
+    }
+    else
+    {
+        auto norm = normalize( data, options.smooth );
+
+            //  normalize() trims 'smooth' samples at the start
+        demod = demodulate_chunked( norm, rate, options.smooth, options );
+    }
+
+    if (options.repair)
+        demod = repair( data, rate, demod, options );
+    if (options.verify)
+        demod.source = std::move( data );
+
+    return demod;
+}
+
+/// @brief Bounded lock-free queue between exactly one producer thread and one consumer thread.
+/// Indices only grow and are masked on access; each side writes its own index, and reads the other one to know if there is room or data
+template <class T, size_t N>
+class spsc_ring
+{
+    static_assert( N!=0 && (N&(N-1))==0, "capacity must be a power of 2" );
+
+    T items_[N];
+    alignas(64) std::atomic<size_t> head_{ 0 };     //  Next item to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail_{ 0 };     //  Next slot to fill, written by the producer
+
+public:
+    bool try_push( T &item )
+    {
+        size_t tail = tail_.load( std::memory_order_relaxed );
+        if (tail-head_.load( std::memory_order_acquire )==N)
+            return false;
+        items_[tail&(N-1)] = std::move( item );
+        tail_.store( tail+1, std::memory_order_release );
+        return true;
+    }
+
+    bool try_pop( T &item )
+    {
+        size_t head = head_.load( std::memory_order_relaxed );
+        if (head==tail_.load( std::memory_order_acquire ))
+            return false;
+        item = std::move( items_[head&(N-1)] );
+        head_.store( head+1, std::memory_order_release );
+        return true;
+    }
+
+        //  Stages run at different speeds, so the fast side waits for the slow one to catch up. It yields a few times,
+        //  then sleeps, twice as long each time up to a millisecond (well below the time to process a block), so that
+        //  a stage stalled behind a slow one does not burn a core
+    static void back_off( unsigned &tries )
+    {
+        if (tries<16)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for( std::chrono::microseconds( 1<<std::min( tries-16, 10U ) ) );
+        tries++;
+    }
+
+    void push( T item )
+    {
+        unsigned tries = 0;
+        while (!try_push( item ))
+            back_off( tries );
+    }
+
+    T pop()
+    {
+        T item;
+        unsigned tries = 0;
+        while (!try_pop( item ))
+            back_off( tries );
+        return item;
+    }
+};
+
+    //  Samples per block exchanged between the pipeline stages, and blocks in flight between two stages
+const size_t PIPELINE_BLOCK = 64*1024;
+const size_t PIPELINE_DEPTH = 8;
+
+/// @brief Samples travelling between the pipeline stages. The last block of the stream is flagged (and may be empty)
+struct sample_block
+{
+    std::vector<sample_t> samples;
+    bool last = false;
+};
+
+/// @brief Crossings found in one sample block
+struct crossing_block
+{
+    std::vector<uint32_t> intervals;
+    bool last = false;
+};
+
+/// @brief Bits, positions, fixes and damage produced from one crossing block. The last one also carries the statistics
+struct bit_block
+{
+    demodulated part;
+    bool last = false;
+};
+
+using sample_ring = spsc_ring<sample_block,PIPELINE_DEPTH>;
+using crossing_ring = spsc_ring<crossing_block,PIPELINE_DEPTH>;
+using bit_ring = spsc_ring<bit_block,PIPELINE_DEPTH>;
+
+/// @brief Demodulation stage: feeds the parser block by block, and forwards what each block produced
+template <class P>
+void demodulate_stage( P &p, crossing_ring &in, bit_ring &out )
+{
+    size_t bits = 0, fixes = 0, damage = 0;     //  What was already forwarded
+    for (;;)
+    {
+        crossing_block block = in.pop();
+        for (auto interval:block.intervals)
+            p.add( interval );
+
+        bit_block result;
+        result.part.bits.assign( p.result.begin()+bits, p.result.end() );
+        result.part.positions.assign( p.positions.begin()+bits, p.positions.end() );
+        result.part.fixes.assign( p.fixes.begin()+fixes, p.fixes.end() );
+        result.part.damage.assign( p.damage.begin()+damage, p.damage.end() );
+        bits = p.result.size();
+        fixes = p.fixes.size();
+        damage = p.damage.size();
+        result.last = block.last;
+        if (block.last)
+            result.part.stats = std::move( p.stats );
+        out.push( std::move( result ) );
+        if (block.last)
+            return;
+    }
+}
+
+/// @brief Demodulation stage with the parser specialized for SAMPLE_RATE (and for the default tolerance)
+template <uint32_t SAMPLE_RATE>
+void demodulate_stage( crossing_ring &in, bit_ring &out, size_t start, double tolerance )
+{
+    if (tolerance==1)
+    {
+        Parser<SAMPLE_RATE> p{ start };
+        demodulate_stage( p, in, out );
+    }
+    else
+    {
+        Parser<SAMPLE_RATE,true> p{ start, tolerance };
+        demodulate_stage( p, in, out );
+    }
+}
+
+/// @brief Same as decode_take() on a mono file, but reading, conditioning (up to the crossings) and demodulation each run
+/// on their own thread, connected by ring buffers of sample, crossing and bit blocks. This thread collects the bits.
+/// Framing and search need the whole record (the checksum is at the end), so they still run once the stream is done
+/// @param read_block fills a sample_block with the next samples of the file, and flags the last one
+template <typename F>
+demodulated decode_pipelined( F read_block, uint32_t rate, const decode_options &options )
+{
+    sample_ring raw;
+    crossing_ring conditioned;
+    bit_ring bits;
+    std::vector<sample_t> kept;     //  Conditioned samples, for the repair and the verification
+
+    std::thread reader( [&]
+    {
+        for (;;)
+        {
+            sample_block block;
+            read_block( block );
+            bool last = block.last;
+            raw.push( std::move( block ) );
+            if (last)
+                return;
+        }
+    } );
+
+    std::thread filter( [&]
+    {
+        conditioner agc{ rate };
+        smoother smooth{ (size_t)options.smooth };
+            //  The smoother trims 'smooth' samples at the start
+        crossing_detector detector{ rate, (size_t)options.smooth, options.hysteresis };
+        for (;;)
+        {
+            sample_block block = raw.pop();
+            if (options.agc)
+                agc.process( block.samples.data(), block.samples.data()+block.samples.size() );
+            if (options.repair || options.verify)
+                kept.insert( kept.end(), block.samples.begin(), block.samples.end() );
+            if (options.smooth)
+            {
+                sample_block smoothed;
+                smoothed.samples.reserve( block.samples.size() );
+                smooth.process( block.samples.data(), block.samples.data()+block.samples.size(), smoothed.samples );
+                smoothed.last = block.last;
+                block = std::move( smoothed );
+            }
+            crossing_block crossings;
+            detector.process( block.samples.data(), block.samples.data()+block.samples.size(), crossings.intervals );
+            crossings.last = block.last;
+            conditioned.push( std::move( crossings ) );
+            if (block.last)
+                return;
+        }
+    } );
+
+    std::thread demodulator( [&]
+    {
+        switch (rate)
+        {
+            case 22050: demodulate_stage<22050>( conditioned, bits, options.smooth, options.tolerance ); break;
+            case 44100: demodulate_stage<44100>( conditioned, bits, options.smooth, options.tolerance ); break;
+            case 48000: demodulate_stage<48000>( conditioned, bits, options.smooth, options.tolerance ); break;
+            case 96000: demodulate_stage<96000>( conditioned, bits, options.smooth, options.tolerance ); break;
+        }
+    } );
+
+    demodulated result;
+    for (;;)
+    {
+        bit_block block = bits.pop();
+        auto &part = block.part;
+        result.bits.insert( result.bits.end(), part.bits.begin(), part.bits.end() );
+        result.positions.insert( result.positions.end(), part.positions.begin(), part.positions.end() );
+        result.fixes.insert( result.fixes.end(), part.fixes.begin(), part.fixes.end() );
+        result.damage.insert( result.damage.end(), part.damage.begin(), part.damage.end() );
+        if (block.last)
+        {
+            result.stats = std::move( part.stats );
+            break;
+        }
+    }
+
+    reader.join();
+    filter.join();
+    demodulator.join();
+    diag.flush();
+
+    if (options.repair)
+        result = repair( kept, rate, result, options );
+    if (options.verify)
+        result.source = std::move( kept );
+
+    return result;
+}
+
+/// @brief Demodulates each take, and fuses them if there are several
+/// @param parallel demodulate the takes on their own threads
+demodulated decode_takes( std::vector<std::vector<sample_t>> sources, uint32_t rate, const decode_options &options, bool parallel )
+{
+    std::vector<demodulated> takes( sources.size() );
+    auto decode = [&]( size_t i ) { takes[i] = decode_take( std::move( sources[i] ), rate, options ); };
+    if (parallel && sources.size()>1)
+    {
+        std::vector<std::thread> threads;
+        for (size_t i=0;i!=sources.size();i++)
+            threads.emplace_back( decode, i );
+        for (auto &t:threads)
+            t.join();
+    }
+    else
+        for (size_t i=0;i!=sources.size();i++)
+            decode( i );
+    diag.flush();
+
+    if (takes.size()==1)
+        return takes[0];
+
+    if (!quiet)
+        for (size_t i=0;i!=takes.size();i++)
+            std::clog << "Take #" << i+1 << ": " << takes[i].bits.size() << " bits, " << takes[i].fixes.size() << " unknown bits\n";
+    return fuse( takes, rate );
+}
+
+/// @brief A decode job received by the server
+struct job_t
+{
+    std::string path;                           //  File to decode, or empty if the samples are inline
+    std::vector<std::vector<sample_t>> sources; //  Inline samples
+    uint32_t rate = 0;
+    decode_options options;
+    std::chrono::steady_clock::time_point queued;
+    std::promise<std::string> response;
+};
+
+/// @brief Decodes a job, and formats the response: a MATCH line per record, a STATS line and END
+std::string run_job( job_t &job )
+{
+    auto start = std::chrono::steady_clock::now();
+    std::ostringstream out;
+
+    if (job.path!="" && !read_audio( job.path.c_str(), job.rate, job.sources ))
+        return "ERROR cannot read "+job.path+"\nEND\n";
+    if (!supported_rate( job.rate ))
+        return "ERROR unsupported sample rate\nEND\n";
+
+    size_t samples = 0;
+    for (auto &s:job.sources)
+        samples += s.size();
+
+    auto demod = decode_takes( std::move( job.sources ), job.rate, job.options, false );
+    auto bs = demod.get_bitstream();
+    synthesis_verifier verifier{ demod.source, job.rate };
+    auto matches = search( bs, job.options, []( const kim_data & ) {}, demod.source.empty()?nullptr:&verifier, demod.bit_times() );
+
+    char buffer[256];
+    for (auto &kd:matches)
+    {
+        ::snprintf( buffer, sizeof(buffer), "MATCH ID=%02X ADRS=%04X CHKSUM=%04X DATA=", kd.id, kd.adrs, kd.checksum );
+        out << buffer;
+        for (size_t i=3;i<kd.data.size();i++)
+            out << "0123456789ABCDEF"[kd.data[i]/16] << "0123456789ABCDEF"[kd.data[i]%16];
+        out << "\n";
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    ::snprintf( buffer, sizeof(buffer), "STATS samples=%zu bits=%zu unknown=%zu matches=%zu queue_ms=%.3f decode_ms=%.3f\n",
+        samples, bs.raw_bits().size(), bs.error_count(), matches.size(),
+        std::chrono::duration<double,std::milli>( start-job.queued ).count(),
+        std::chrono::duration<double,std::milli>( end-start ).count() );
+    out << buffer << "END\n";
+
+    return out.str();
+}
+
+/// @brief Fixed set of worker threads consuming a queue of jobs
+class worker_pool
+{
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<job_t>> queue_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+
+    void work()
+    {
+        while (true)
+        {
+            std::shared_ptr<job_t> job;
+            {
+                std::unique_lock<std::mutex> lock{ mutex_ };
+                cv_.wait( lock, [&]{ return queue_.size()>0 || stopping_; } );
+                if (queue_.empty())
+                    return;
+                job = queue_.front();
+                queue_.pop_front();
+            }
+            job->response.set_value( run_job( *job ) );
+        }
+    }
+
+public:
+    worker_pool( size_t count )
+    {
+        for (size_t i=0;i!=count;i++)
+            threads_.emplace_back( &worker_pool::work, this );
+    }
+
+    /// @brief Runs the queued jobs, then joins the workers
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t:threads_)
+            t.join();
+    }
+
+    void submit( std::shared_ptr<job_t> job )
+    {
+        job->queued = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock{ mutex_ };
+            queue_.push_back( job );
+        }
+        cv_.notify_one();
+    }
+};
+
+/// @brief Buffered reading of lines and bytes from a socket
+class socket_reader
+{
+    int fd_;
+    std::vector<char> buffer_;
+    size_t begin_ = 0;
+
+    bool fill()
+    {
+        if (begin_>0)
+        {
+            buffer_.erase( std::begin(buffer_), std::begin(buffer_)+begin_ );
+            begin_ = 0;
+        }
+        char tmp[64*1024];
+        ssize_t len = ::read( fd_, tmp, sizeof(tmp) );
+        if (len<=0)
+            return false;
+        buffer_.insert( std::end(buffer_), tmp, tmp+len );
+        return true;
+    }
+
+public:
+    socket_reader( int fd ) : fd_{ fd } {}
+
+    bool read_line( std::string &line )
+    {
+        while (true)
+        {
+            auto b = std::begin(buffer_)+begin_;
+            auto eol = std::find( b, std::end(buffer_), '\n' );
+            if (eol!=std::end(buffer_))
+            {
+                line.assign( b, eol );
+                begin_ = eol+1-std::begin(buffer_);
+                return true;
+            }
+            if (!fill())
+                return false;
+        }
+    }
+
+    bool read_bytes( size_t count, std::vector<sample_t> &bytes )
+    {
+        while (buffer_.size()-begin_<count)
+            if (!fill())
+                return false;
+        bytes.assign( std::begin(buffer_)+begin_, std::begin(buffer_)+begin_+count );
+        begin_ += count;
+        return true;
+    }
+};
+
+bool write_all( int fd, const std::string &s )
+{
+    size_t done = 0;
+    while (done<s.size())
+    {
+        ssize_t len = ::write( fd, s.data()+done, s.size()-done );
+        if (len<=0)
+            return false;
+        done += len;
+    }
+    return true;
+}
+
+    //  Limits of the server: open connections, samples of a SAMPLES job, and jobs of a connection waiting for their response
+const size_t SERVER_MAX_CONNECTIONS = 64;
+const size_t SERVER_MAX_SAMPLES = (size_t)1<<27;
+const size_t SERVER_MAX_PENDING = 16;
+
+/// @brief Open connections of the server, so that QUIT can end them all
+class connection_set
+{
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<int> fds_;
+    int listener_;
+    bool stopping_ = false;
+
+public:
+    connection_set( int listener ) : listener_{ listener } {}
+
+    /// @return false if the server is stopping or has too many connections
+    bool add( int fd )
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        if (stopping_ || fds_.size()>=SERVER_MAX_CONNECTIONS)
+            return false;
+        fds_.push_back( fd );
+        return true;
+    }
+
+    /// @brief Closes a connection (under the lock, so that stop() never sees a reused descriptor)
+    void remove( int fd )
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        fds_.erase( std::find( std::begin(fds_), std::end(fds_), fd ) );
+        ::close( fd );
+        cv_.notify_all();
+    }
+
+    /// @brief Stops accepting connections, and stops reading the requests of the open ones. Their pending jobs still get a response
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        stopping_ = true;
+        ::shutdown( listener_, SHUT_RDWR );
+        for (auto fd:fds_)
+            ::shutdown( fd, SHUT_RD );
+    }
+
+    bool stopping()
+    {
+        std::lock_guard<std::mutex> lock{ mutex_ };
+        return stopping_;
+    }
+
+    void wait_closed()
+    {
+        std::unique_lock<std::mutex> lock{ mutex_ };
+        cv_.wait( lock, [&]{ return fds_.empty(); } );
+    }
+};
 
-        //  we patch according to user specs
-    bs.patch( patch );
+/// @brief Handles the requests of a client. Requests can be pipelined: they are read and queued while the previous
+/// ones are decoded, and the responses are sent in the order of the requests.
+///   DECODE <path> [options]                   decode a WAV file
+///   SAMPLES <rate> <count> [options]          decode the <count> unsigned 8 bits mono samples that follow the line (at most SERVER_MAX_SAMPLES)
+///   QUIT                                      stop the server, once the pending jobs are answered
+/// Options are --smooth N, --hysteresis N|auto, --tolerance F, --prescan true|false, --agc true|false, --repair true|false, --verify true|false, --search MODE, --patch PATCH and --deadline SECONDS
+void serve_connection( int fd, worker_pool &pool, connection_set &connections )
+{
+        //  Responses waiting to be sent, in the order of the requests
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::future<std::string>> pending;
+    bool done = false;
 
-        //  we interate all the solutions
-    std::clog << "Generating " << bs.fix_count() << " combinations\n";
-    for (size_t i=0;i!=bs.fix_count();i++)
+    std::thread responder( [&]
     {
-        auto bits = bs.bits( i );
-        kim_data kd;
-        if (kim_data_from_bits( bits, kd ))
+        bool ok = true;
+        while (true)
         {
-            bool found = false; // ### use std::algo!
-            for (auto &k:matches)
-                if (k==kd)
-                    found = true;
-            if (!found)
+            std::future<std::string> next;
+            {
+                std::unique_lock<std::mutex> lock{ mutex };
+                cv.wait( lock, [&]{ return pending.size()>0 || done; } );
+                if (pending.empty())
+                    return;
+                next = std::move( pending.front() );
+                pending.pop_front();
+            }
+            cv.notify_all();
+            auto response = next.get();
+                //  The client is gone: stop reading its requests, but still wait for the queued jobs
+            if (ok && !write_all( fd, response ))
             {
-                matches.push_back( kd );
-                std::clog << "Found parsable data with correct checksum:\n";
-                kd.dump();
+                ok = false;
+                ::shutdown( fd, SHUT_RD );
             }
         }
-    }
+    } );
 
-    if (flag_write_data || flag_write_kim || flag_write_bits || flag_write_wav)
+    socket_reader in{ fd };
+    std::string line;
+    while (in.read_line( line ))
     {
-        if (matches.size()==0)
-            std::cerr << "**** Not data recovered, cannot write data\n";
-        if (matches.size()>1)
-            std::cerr << "**** Several data matches, writing first match\n";
-        if (matches.size()>=1)
+        std::istringstream words{ line };
+        std::string command;
+        words >> command;
+
+        auto job = std::make_shared<job_t>();
+        std::string error;
+        bool last = false;
+        if (command=="DECODE")
         {
-            if (flag_write_data)
-                write_data( matches[0] );
-            if (flag_write_kim)
-                write_kim( matches[0] );
-            if (flag_write_bits)
-                write_bits( matches[0] );
-            if (flag_write_wav)
-                write_wav( matches[0] );
+            words >> job->path;
+            if (job->path=="")
+                error = "missing path";
         }
-    }
-
-// exit(0);
+        else if (command=="SAMPLES")
+        {
+            size_t count = 0;
+            words >> job->rate >> count;
+            job->sources.resize( 1 );
+                //  The samples cannot be skipped, the connection is closed after the error
+            if (count>SERVER_MAX_SAMPLES)
+            {
+                error = "too many samples";
+                last = true;
+            }
+            else if (!in.read_bytes( count, job->sources[0] ))
+                break;
+        }
+        else if (command=="QUIT")
+        {
+            connections.stop();
+            break;
+        }
+        else
+            error = "unknown command "+command;
 
-//     if (bs.errors()>0)
-//     {
-//         std::cout << "Location in bitstream for corrupted segments:\n";
-//         for (int i=0;i!=p.fixes.size();i++)
-//         {
-//             auto f = p.fixes[i];
-//             bool bit = patch[i%patch.size()]=='1';
-//             std::cout << "  " << from_time( f.timestamp ) << "-" << from_time( f.timestamp+7.452/1000 ) << " -- bit #" << f.bit_location << " inserted " << bit << "\n";
-//             p.result[p.fixes[i].bit_location] = bit;
-//         }
-    // }
-}
+        std::string name, value;
+        while (error=="" && words >> name >> value)
+        {
+            if (name=="--smooth")
+                job->options.smooth = ::atoi( value.c_str() );
+            else if (name=="--prescan")
+                job->options.prescan = bool_from_string( value );
+            else if (name=="--tolerance")
+                job->options.tolerance = ::atof( value.c_str() );
+            else if (name=="--hysteresis")
+                job->options.hysteresis = value=="auto"?HYSTERESIS_AUTO : ::atoi( value.c_str() );
+            else if (name=="--agc")
+                job->options.agc = bool_from_string( value );
+            else if (name=="--repair")
+                job->options.repair = bool_from_string( value );
+            else if (name=="--verify")
+                job->options.verify = bool_from_string( value );
+            else if (name=="--search" && (value=="auto" || value=="enumerate" || value=="solve"))
+                job->options.search = value;
+            else if (name=="--patch")
+                job->options.patch = value;
+            else if (name=="--deadline")
+                job->options.deadline = ::atof( value.c_str() );
+            else
+                error = "bad option "+name;
+        }
 
+        {
+            std::unique_lock<std::mutex> lock{ mutex };
+            cv.wait( lock, [&]{ return pending.size()<SERVER_MAX_PENDING; } );
+            pending.push_back( job->response.get_future() );
+        }
+        cv.notify_all();
+        if (error!="")
+            job->response.set_value( "ERROR "+error+"\nEND\n" );
+        else
+            pool.submit( job );
+        if (last)
+            break;
+    }
 
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        done = true;
+    }
+    cv.notify_all();
+    responder.join();
+    connections.remove( fd );
+}
 
-std::vector<sample_t> normalize( const std::vector<sample_t> &data, int width=0 )
+/// @brief Decode daemon: listens on a Unix domain socket and runs the jobs on a persistent pool of workers
+int run_server( const char *path, size_t workers )
 {
-    if (width==0)
-        return data;
-
-    if (data.size()<2*width+1)
-        return {};
+    ::signal( SIGPIPE, SIG_IGN );
+    silent = true;
+    verbose = false;    //  The jobs run on the workers concurrently, and must not trace
+    quiet = true;
+
+    int fd = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    ::strncpy( addr.sun_path, path, sizeof(addr.sun_path)-1 );
+    ::unlink( path );
+    if (fd<0 || ::bind( fd, (sockaddr *)&addr, sizeof(addr) )<0 || ::listen( fd, 64 )<0)
+    {
+        std::cerr << "Cannot listen on " << path << ": " << ::strerror( errno ) << "\n";
+        return EXIT_FAILURE;
+    }
 
-    auto b = std::begin( data );
-    auto e = std::end( data );
-    std::vector<sample_t> result;
+    worker_pool pool{ workers };
+    connection_set connections{ fd };
+    std::clog << "Listening on " << path << " with " << workers << " workers\n";
 
-    for (auto d=b+width;d!=e-width;d++)
+    while (true)
     {
-        sample_t min = 255;
-        sample_t max = 0;
-        int sum = 0;
-        for (auto p=d-width;p!=d+width;p++)
+        int client = ::accept( fd, nullptr, nullptr );
+        if (client<0)
         {
-            min = std::min(min,*p);
-            max = std::max(max,*p);
-            sum += *p;
+            if (errno==EINTR)
+                continue;
+            if (connections.stopping())
+                break;
+            std::cerr << "accept failed: " << ::strerror( errno ) << "\n";
+            return EXIT_FAILURE;
         }
-        double value = *d;
-        double avg = sum/(2*width+1);
-
-        if (value>avg)
-            value = 255;
-            // value = (value-avg)/(max-avg+1)*127+128;
-        else
-            // value = 127-(avg-value)/(avg-min+1)*127;
-            value = 0;
-
-       result.push_back( value );
-
-        // for (int i=0;i<value;i++)
-        //     std::cout << "*";
-        // std::cout << "\n";
+        if (!connections.add( client ))
+        {
+            write_all( client, "ERROR too many connections\nEND\n" );
+            ::close( client );
+            continue;
+        }
+        std::thread( serve_connection, client, std::ref( pool ), std::ref( connections ) ).detach();
     }
 
-    // while (b!=e)
-    //     result.push_back( *b++ );
-
-    return result;
+        //  QUIT: the connection threads are done once all the connections are closed, and the pool joins its workers
+    connections.wait_closed();
+    ::close( fd );
+    ::unlink( path );
+    std::clog << "Server stopped\n";
+    return EXIT_SUCCESS;
 }
 
-
-
-
-
-
-
-bool bool_from_string( const std::string s )
+/// @brief Prints what prescan() finds in each channel of each file: clean, damaged or empty, and where the records are
+int triage( const std::vector<const char *> &file_names )
 {
-    if (s=="true")
-        return true;
-    return false;
+    for (auto file_name:file_names)
+    {
+        uint32_t rate;
+        std::vector<std::vector<sample_t>> channels;
+        if (!read_audio( file_name, rate, channels ))
+            return EXIT_FAILURE;
+        for (size_t c=0;c!=channels.size();c++)
+        {
+            auto regions = prescan( channels[c], rate );
+            bool clean = std::all_of( std::begin(regions), std::end(regions), []( const tone_region &r ) { return r.clean(); } );
+            std::cout << file_name;
+            if (channels.size()>1)
+                std::cout << " #" << c+1;
+            std::cout << ": " << (regions.empty()?"empty":clean?"clean":"damaged") << ", " << regions.size() << " records\n";
+            for (auto &r:regions)
+                std::cout << "  " << from_time( r.start/(double)rate ) << "-" << from_time( r.end/(double)rate )
+                    << " " << (r.clean()?"clean":"damaged") << " (leader " << std::fixed << std::setprecision( 1 ) << r.leader
+                    << "s, " << std::setprecision( 0 ) << r.damaged*100 << "% damaged)\n" << std::defaultfloat;
+        }
+    }
+    return EXIT_SUCCESS;
 }
 
-using namespace std;
-
-const int BUFF_SIZE = 1024;
-
 int main(int argc, char* argv[])
 {
-    int smooth = 0;
-    const char *file_name = "input.wav";
-
+    decode_options options;
+    std::vector<const char *> file_names;
+    const char *server_path = nullptr;
+    size_t workers = std::max( std::thread::hardware_concurrency(), 1U );
+    bool pipeline = true;
+    bool triage_only = false;
+
+        //  The cheap checks, the others run with --self-test
     test_bitstream();
-
-    std::string patch;
+    test_crossings();
+    test_parser();
 
     argc--;
     argv++;
@@ -1015,22 +5115,104 @@ int main(int argc, char* argv[])
     {
         if (!strcmp(*argv,"--help"))
         {
-            std::cerr << "kimreader [--silent true|false] [--verbose true|false] [--smooth <NUM>] [--bitstream] [--bytestream offset] file.wav\n";
+            std::cerr << "kimreader [--silent true|false] [--verbose true|false] [--smooth <NUM>] [--hysteresis <NUM>|auto] [--agc true|false] [--repair true|false] [--bitstream] [--bytestream offset] file.wav...\n";
+            std::cerr << "  files are unsigned 8 bits WAV or FLAC (of any sample size, decoded without external tools)\n";
+            std::cerr << "  several files, or a multi-channel file: each channel of each file is demodulated, then they are aligned and fused\n";
+            std::cerr << "  --hysteresis N|auto: a crossing needs the signal to go N above or below 128 (auto: a quarter of the amplitude), ignores noise around the midline\n";
+            std::cerr << "  --tolerance F: scales the accepted deviation of the pulse widths (default 1, from 0.1 to 2)\n";
+            std::cerr << "  --agc true|false: streaming DC removal and gain control, a cheap alternative to --smooth for low or off-center signals\n";
+            std::cerr << "  --repair true|false: re-demodulates only the damaged parts of the tape with wider smoothing and gain control\n";
+            std::cerr << "  --verify true|false: compares the unknown bits with a synthesized signal, to settle the clear ones before the search and rank the records found (default false, keeps the samples of the take in memory)\n";
             std::cerr << "  --bitstream: dumps the bitstream (with error replaced by zeros)\n";
             std::cerr << "  --bytestream OFFSET: transform the bitstream into bytes, skipping offset bits\n";
-            std::cerr << "  --output data|kim|bits|wav: output the data on the standard output in the specified format\n";
+            std::cerr << "  --output data|kim|bits|wav[=FILE]: output the data on the standard output (or in FILE) in the specified format\n";
+            std::cerr << "  --search auto|enumerate|solve: try all combinations of unknown bits, or solve for the checksum (auto: solve above 16 unknown bits)\n";
+            std::cerr << "  --deadline SECONDS: stop trying combinations after SECONDS, and use what was found so far\n";
+            std::cerr << "  --checkpoint FILE: save the progress of the search in FILE, and resume from it if it exists\n";
+            std::cerr << "  --stats FILE.json|FILE.csv: exports histograms of crossing widths and pulse groups, and the '*', '?' and '#' per second\n";
+            std::cerr << "  --server SOCKET [--workers N]: decode daemon, takes jobs on a Unix domain socket (see serve_connection)\n";
+            std::cerr << "  --prescan true|false: only demodulate the records found by a quick scan of the tones (for long captures)\n";
+            std::cerr << "  --triage: only print the records found by the quick scan, and if the files look clean, damaged or empty\n";
+            std::cerr << "  --threads N: cuts long captures into chunks demodulated on N threads (disables the pipeline)\n";
+            std::cerr << "  --pipeline true|false: read, condition and demodulate a mono file on separate threads (default true)\n";
+            std::cerr << "  --log FILE: write the bitstream, bytestream and parser traces to FILE instead of stderr\n";
+            std::cerr << "  --self-test: runs the slower self-tests (solver, enumeration, realignment, chunks, FLAC, synthesis) and exits\n";
             std::cerr << "  silent false mode:\n";
             std::cerr << "  '*' : got an zero crossing that is not 2400Hz or 3700Hz\n";
-            std::cerr << "  '?' : got a transition from 2400Hz to 3700Hz that is not in a 9-9-6 or 9-6-6 pattern\n";
+            std::cerr << "  '?' : got a transition from 2400Hz to 3700Hz that is not in a 9-9-6 or 9-6-6 pattern (an unknown bit, unless part of the previous one)\n";
             std::cerr << "  '#' : inserting an unknown bit\n";
             std::cerr << "        (insertion is only done *after* a first know bit is found, and only if followed by a known bit)\n";
             return EXIT_FAILURE;
         }
+        else if (!strcmp(*argv,"--self-test"))
+        {
+            test_solver();
+            test_sliced();
+            test_realign();
+            test_enumerate();
+            test_chunked();
+            test_flac();
+            test_synthesis();
+            std::cerr << "Self-test passed\n";
+            return EXIT_SUCCESS;
+        }
         else if (!strcmp(*argv,"--smooth"))
         {
             argc--;
             argv++;
-            smooth = ::atoi( *argv );
+            options.smooth = ::atoi( *argv );
+        }
+        else if (!strcmp(*argv,"--hysteresis"))
+        {
+            argc--;
+            argv++;
+            options.hysteresis = !strcmp(*argv,"auto")?HYSTERESIS_AUTO : ::atoi( *argv );
+        }
+        else if (!strcmp(*argv,"--prescan"))
+        {
+            argc--;
+            argv++;
+            options.prescan = ::bool_from_string( *argv );
+        }
+        else if (!strcmp(*argv,"--triage"))
+        {
+            triage_only = true;
+        }
+        else if (!strcmp(*argv,"--threads"))
+        {
+            argc--;
+            argv++;
+            options.threads = std::max( ::atoi( *argv ), 1 );
+        }
+        else if (!strcmp(*argv,"--tolerance"))
+        {
+            argc--;
+            argv++;
+            options.tolerance = ::atof( *argv );
+        }
+        else if (!strcmp(*argv,"--agc"))
+        {
+            argc--;
+            argv++;
+            options.agc = ::bool_from_string( *argv );
+        }
+        else if (!strcmp(*argv,"--repair"))
+        {
+            argc--;
+            argv++;
+            options.repair = ::bool_from_string( *argv );
+        }
+        else if (!strcmp(*argv,"--verify"))
+        {
+            argc--;
+            argv++;
+            options.verify = ::bool_from_string( *argv );
+        }
+        else if (!strcmp(*argv,"--pipeline"))
+        {
+            argc--;
+            argv++;
+            pipeline = ::bool_from_string( *argv );
         }
         else if (!strcmp(*argv,"--silent"))
         {
@@ -1059,125 +5241,194 @@ int main(int argc, char* argv[])
         {
             argc--;
             argv++;
-            if (*argv=="data"s)    //  Just the data, in binary, as loaded in memory
+                //  Optional '=FILE' suffix to write this format to its own file
+            std::string format = *argv;
+            std::string path;
+            auto equal = format.find( '=' );
+            if (equal!=std::string::npos)
+            {
+                path = format.substr( equal+1 );
+                format = format.substr( 0, equal );
+            }
+            if (format=="data")    //  Just the data, in binary, as loaded in memory
+            {
                 flag_write_data = true;
-            else if (*argv=="kim"s)       //  The content in kim format (100*SYN, headers, etc...)
+                path_write_data = path;
+            }
+            else if (format=="kim")       //  The content in kim format (100*SYN, headers, etc...)
+            {
                 flag_write_kim = true;
-            else if (*argv=="bits"s)      //  The content of tape as raw bits
+                path_write_kim = path;
+            }
+            else if (format=="bits")      //  The content of tape as raw bits
+            {
                 flag_write_bits = true;
-            else if (*argv=="wav"s)      //  The content as a wav tape
+                path_write_bits = path;
+            }
+            else if (format=="wav")      //  The content as a wav tape
+            {
                 flag_write_wav = true;
+                path_write_wav = path;
+            }
             else
             {
                 std::cerr << "output must be data|kim|bits|wav\n";
                 ::exit( EXIT_FAILURE );
             }
         }
+        else if (!strcmp(*argv,"--log"))
+        {
+            argc--;
+            argv++;
+            if (!diag.open( *argv ))
+            {
+                std::cerr << "Could not create file " << *argv << "\n";
+                ::exit( EXIT_FAILURE );
+            }
+        }
+        else if (!strcmp(*argv,"--search"))
+        {
+            argc--;
+            argv++;
+            options.search = *argv;
+            if (options.search!="auto" && options.search!="enumerate" && options.search!="solve")
+            {
+                std::cerr << "search must be auto|enumerate|solve\n";
+                ::exit( EXIT_FAILURE );
+            }
+        }
+        else if (!strcmp(*argv,"--deadline"))
+        {
+            argc--;
+            argv++;
+            options.deadline = ::atof( *argv );
+        }
+        else if (!strcmp(*argv,"--checkpoint"))
+        {
+            argc--;
+            argv++;
+            options.checkpoint = *argv;
+        }
+        else if (!strcmp(*argv,"--stats"))
+        {
+            argc--;
+            argv++;
+            path_stats = *argv;
+        }
+        else if (!strcmp(*argv,"--server"))
+        {
+            argc--;
+            argv++;
+            server_path = *argv;
+        }
+        else if (!strcmp(*argv,"--workers"))
+        {
+            argc--;
+            argv++;
+            workers = std::max( ::atoi( *argv ), 1 );
+        }
         else if (!strcmp(*argv,"--patch"))
         {
             argc--;
             argv++;
-            patch = *argv;
+            options.patch = *argv;
         }
         else
-            file_name = *argv;
+            file_names.push_back( *argv );
         argc--;
         argv++;
     }
 
-  // Open the WAV file in binary mode
-  ifstream file(file_name, ios::binary);
-  if (!file.is_open())
-  {
-    cerr << "Could not open file " << file_name << endl;
-    return 1;
-  }
-
-  // Read the WAV file header
-  char buffer[BUFF_SIZE];
-
-  // Read the chunk ID, should be "RIFF"
-  file.read(buffer, 4);
-  if (string(buffer, 4) != "RIFF")
-  {
-    cerr << "Invalid WAV file" << endl;
-    return 1;
-  }
-
-  // Read the file size
-  uint32_t file_size;
-  file.read((char*)&file_size, sizeof(file_size));
-
-  // Read the file format, should be "WAVE"
-  file.read(buffer, 4);
-  if (string(buffer, 4) != "WAVE")
-  {
-    cerr << "Invalid WAV file" << endl;
-    return 1;
-  }
-
-  // Read the format chunk ID, should be "fmt "
-  file.read(buffer, 4);
-  if (string(buffer, 4) != "fmt ")
-  {
-    cerr << "Invalid WAV file" << endl;
-    return 1;
-  }
-
-  // Read the format chunk size
-  uint32_t format_chunk_size;
-  file.read((char*)&format_chunk_size, sizeof(format_chunk_size));
-
-  // Read the audio format
-  uint16_t audio_format;
-  file.read((char*)&audio_format, sizeof(audio_format));
-
-  // Read the number of channels
-  uint16_t num_channels;
-  file.read((char*)&num_channels, sizeof(num_channels));
-
-  // Read the sample rate
-  uint32_t sample_rate;
-  file.read((char*)&sample_rate, sizeof(sample_rate));
+    if (server_path)
+        return run_server( server_path, workers );
 
-  // Read the byte rate
-  uint32_t byte_rate;
-  file.read((char*)&byte_rate, sizeof(byte_rate));
+    if (file_names.size()==0)
+        file_names.push_back( "input.wav" );
 
-  // Read the block align
-  uint16_t block_align;
-  file.read((char*)&block_align, sizeof(block_align));
+    if (triage_only)
+        return triage( file_names );
 
-  // Read the bits per sample
-  uint16_t bits_per_sample;
-  file.read((char*)&bits_per_sample, sizeof(bits_per_sample));
+    uint32_t sample_rate = 0;
+    demodulated demod;
+    bool pipelined = false;
 
-  // Print the file size, audio format, and number of channels
-//   cout << "File size: " << file_size << " bytes" << endl;
-//   cout << "Audio format: " << audio_format << " bytes" << endl;
-//   cout << "#channels: " << num_channels << " bytes" << endl;
-//   cout << "Sample rate: " << sample_rate << " bytes" << endl;
-//   cout << "Byte size: " << byte_rate << " bytes" << endl;
-//   cout << "Bits per sample: " << bits_per_sample << " bytes" << endl;
+        //  A single mono file is streamed through the pipeline stages
+    if (pipeline && options.threads==1 && !options.prescan && file_names.size()==1 && is_flac( file_names[0] ))
+    {
+        flac_reader flac;
+        if (!flac.open( file_names[0] ))
+            return 1;
+        sample_rate = flac.sample_rate;
+        pipelined = flac.num_channels==1;
+        if (pipelined)
+        {
+                //  Whole frames, until the block is full
+            demod = decode_pipelined( [&]( sample_block &block )
+            {
+                std::vector<std::vector<sample_t>> channels( 1 );
+                channels[0].reserve( PIPELINE_BLOCK+65536 );
+                while (channels[0].size()<PIPELINE_BLOCK && flac.read_frame( channels ))
+                    ;
+                block.last = channels[0].size()<PIPELINE_BLOCK;
+                block.samples = std::move( channels[0] );
+            }, sample_rate, options );
+            if (flac.failed())
+                return 1;
+        }
+    }
+    else if (pipeline && options.threads==1 && !options.prescan && file_names.size()==1)
+    {
+        ifstream file;
+        uint16_t num_channels;
+        uint32_t data_size;
+        if (!open_wav( file, file_names[0], sample_rate, num_channels, data_size ))
+            return 1;
+        pipelined = num_channels==1;
+        if (pipelined)
+        {
+            size_t left = data_size;
+            demod = decode_pipelined( [&]( sample_block &block )
+            {
+                block.samples.resize( std::min( left, PIPELINE_BLOCK ) );
+                file.read( (char *)block.samples.data(), block.samples.size() );
+                block.samples.resize( file.gcount() );
+                left -= block.samples.size();
+                block.last = left==0 || block.samples.empty();
+            }, sample_rate, options );
+        }
+    }
 
-  file.read(buffer, 4);
-  if (string(buffer, 4) != "data")
-  {
-    cerr << "Invalid WAV file" << endl;
-    return 1;
-  }
+    if (!pipelined)
+    {
+        std::vector<std::vector<sample_t>> sources;     //  Each channel of each file is a take
 
-    int32_t sample_count;
-    file.read((char*)&sample_count, 4);
+        sample_rate = 0;
+        for (auto file_name:file_names)
+        {
+            uint32_t rate;
+            std::vector<std::vector<sample_t>> channels;
+            if (!read_audio( file_name, rate, channels ))
+                return 1;
+            if (sample_rate!=0 && rate!=sample_rate)
+            {
+                cerr << "All the files must have the same sample rate" << endl;
+                return 1;
+            }
+            sample_rate = rate;
+            for (auto &c:channels)
+                sources.push_back( std::move( c ) );
+        }
 
-    sample_t *raw_data = new sample_t[sample_count];
-    file.read( (char *)raw_data, sample_count );
-    std::vector<sample_t> data{ raw_data, raw_data+sample_count };
-    delete[] raw_data;
+            //  Takes are independent, so they are demodulated in parallel (unless the parser traces would interleave)
+        demod = decode_takes( std::move( sources ), sample_rate, options, !tracing() );
+    }
 
-    auto norm = normalize( data, smooth );
+    if (path_stats!="" && !write_stats( demod.stats, path_stats ))
+        std::cerr << "Could not write statistics to " << path_stats << "\n";
 
-    parse( norm, patch );
+    synthesis_verifier verifier{ demod.source, sample_rate };
+    parse( demod.get_bitstream(), options, demod.source.empty()?nullptr:&verifier, demod.bit_times() );
 
-    return EXIT_SUCCESS;
+        //  An interrupted enumeration still writes what it found
+    return interrupted?EXIT_FAILURE:EXIT_SUCCESS;
 }